@@ -9,6 +9,221 @@
 #include <stdlib.h>
 #include <string.h>
 
+static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+//  block encoders
+//
+//  Each encodes as many whole 3-byte groups from the start of `in' as it
+//  conveniently can, writing 4 characters per group to `out', and returns
+//  the number of input bytes consumed (a multiple of 3). The vector
+//  versions leave a short tail for the scalar one.
+//
+typedef size_t (*block_encoder)(const unsigned char* in, size_t size, char* out);
+
+static size_t encode_scalar(const unsigned char* in, size_t size, char* out)
+{
+	size_t i;
+
+	for (i = 0; i + 3 <= size; i += 3) {
+		unsigned long c = (unsigned long) in[i] << 16 | in[i+1] << 8 | in[i+2];
+
+		*out++ = base64[(c >> 18) & 0x3f];
+		*out++ = base64[(c >> 12) & 0x3f];
+		*out++ = base64[(c >> 6) & 0x3f];
+		*out++ = base64[c & 0x3f];
+	}
+	return i;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+#define HAVE_X86_ENCODERS 1
+
+//  Spread 12 bytes over 16 lanes of 6 bits: each group of 3 bytes is
+//  shuffled into a 32-bit word, and the four sextets are moved into the
+//  low bits of its bytes by multiplications.
+//
+__attribute__((target("ssse3")))
+static inline __m128i enc_reshuffle_ssse3(__m128i in)
+{
+	__m128i t0, t1, t2, t3;
+
+	in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+	t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+	t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+	t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+	return _mm_or_si128(t1, t3);
+}
+
+//  Map sextets to the alphabet by adding a per-range offset: 0..25 'A',
+//  26..51 'a', 52..61 '0', 62 '+', 63 '/'.
+//
+__attribute__((target("ssse3")))
+static inline __m128i enc_translate_ssse3(__m128i in)
+{
+	const __m128i lut = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+	__m128i idx = _mm_subs_epu8(in, _mm_set1_epi8(51));
+
+	idx = _mm_sub_epi8(idx, _mm_cmpgt_epi8(in, _mm_set1_epi8(25)));
+	return _mm_add_epi8(in, _mm_shuffle_epi8(lut, idx));
+}
+
+__attribute__((target("ssse3")))
+static size_t encode_ssse3(const unsigned char* in, size_t size, char* out)
+{
+	size_t i;
+
+	/* 12 bytes in per step, but each load reads 16 */
+	for (i = 0; i + 16 <= size; i += 12) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (in + i));
+
+		v = enc_translate_ssse3(enc_reshuffle_ssse3(v));
+		_mm_storeu_si128((__m128i*) out, v);
+		out += 16;
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i enc_reshuffle_avx2(__m256i in)
+{
+	__m256i t0, t1, t2, t3;
+
+	in = _mm256_shuffle_epi8(in, _mm256_set_epi8(
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+	t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+	t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+	t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+	return _mm256_or_si256(t1, t3);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i enc_translate_avx2(__m256i in)
+{
+	const __m256i lut = _mm256_setr_epi8(
+		65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+		65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+	__m256i idx = _mm256_subs_epu8(in, _mm256_set1_epi8(51));
+
+	idx = _mm256_sub_epi8(idx, _mm256_cmpgt_epi8(in, _mm256_set1_epi8(25)));
+	return _mm256_add_epi8(in, _mm256_shuffle_epi8(lut, idx));
+}
+
+__attribute__((target("avx2")))
+static size_t encode_avx2(const unsigned char* in, size_t size, char* out)
+{
+	size_t i;
+
+	/* 24 bytes in per step: 12 for each 128-bit lane */
+	for (i = 0; i + 28 <= size; i += 24) {
+		__m256i v = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*) (in + i))),
+			_mm_loadu_si128((const __m128i*) (in + i + 12)), 1);
+
+		v = enc_translate_avx2(enc_reshuffle_avx2(v));
+		_mm256_storeu_si256((__m256i*) out, v);
+		out += 32;
+	}
+	return i;
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+
+#define HAVE_NEON_ENCODER 1
+
+static size_t encode_neon(const unsigned char* in, size_t size, char* out)
+{
+	uint8x16x4_t lut, res;
+	size_t i;
+
+	lut.val[0] = vld1q_u8((const uint8_t*) base64);
+	lut.val[1] = vld1q_u8((const uint8_t*) base64 + 16);
+	lut.val[2] = vld1q_u8((const uint8_t*) base64 + 32);
+	lut.val[3] = vld1q_u8((const uint8_t*) base64 + 48);
+
+	/* 48 bytes in per step, split into the three bytes of each group */
+	for (i = 0; i + 48 <= size; i += 48) {
+		uint8x16x3_t v = vld3q_u8(in + i);
+
+		res.val[0] = vshrq_n_u8(v.val[0], 2);
+		res.val[1] = vandq_u8(vorrq_u8(vshrq_n_u8(v.val[1], 4), vshlq_n_u8(v.val[0], 4)), vdupq_n_u8(0x3f));
+		res.val[2] = vandq_u8(vorrq_u8(vshrq_n_u8(v.val[2], 6), vshlq_n_u8(v.val[1], 2)), vdupq_n_u8(0x3f));
+		res.val[3] = vandq_u8(v.val[2], vdupq_n_u8(0x3f));
+
+		res.val[0] = vqtbl4q_u8(lut, res.val[0]);
+		res.val[1] = vqtbl4q_u8(lut, res.val[1]);
+		res.val[2] = vqtbl4q_u8(lut, res.val[2]);
+		res.val[3] = vqtbl4q_u8(lut, res.val[3]);
+		vst4q_u8((uint8_t*) out, res);
+		out += 64;
+	}
+	return i;
+}
+#endif
+
+//  Pick the widest block encoder the CPU supports, once: where the
+//  compiler allows, as the program starts, before any threads could race to.
+//
+#ifdef __GNUC__
+__attribute__((constructor))
+#endif
+static block_encoder select_encoder(void)
+{
+	static block_encoder encoder;
+
+	if (encoder == NULL) {
+		block_encoder e = encode_scalar;
+
+#if HAVE_X86_ENCODERS
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			e = encode_avx2;
+		else if (__builtin_cpu_supports("ssse3"))
+			e = encode_ssse3;
+#elif HAVE_NEON_ENCODER
+		e = encode_neon;
+#endif
+		encoder = e;
+	}
+	return encoder;
+}
+
+//  base64 encoding into a buffer
+//
+//  buf:     binary input data
+//  size:    size of input (bytes)
+//  out:     room for BASE64_LENGTH(size) characters
+//  return:  number of characters written (no null-terminator)
+//
+size_t base64_encode_into(const void* buf, size_t size, char* out)
+{
+	const unsigned char* q = (const unsigned char*) buf;
+	char* p = out;
+	size_t i;
+
+	i = select_encoder()(q, size, p);
+	i += encode_scalar(q + i, size - i, p + i / 3 * 4);
+	p += i / 3 * 4;
+
+	if (i < size) {
+		unsigned long c = (unsigned long) q[i] << 16;
+
+		if (i + 1 < size)
+			c |= q[i+1] << 8;
+		*p++ = base64[(c >> 18) & 0x3f];
+		*p++ = base64[(c >> 12) & 0x3f];
+		*p++ = (i + 1 < size) ? base64[(c >> 6) & 0x3f] : '=';
+		*p++ = '=';
+	}
+	return p - out;
+}
+
 //  base64 encoding
 //
 //  buf:     binary input data
@@ -18,45 +233,13 @@
 //
 char* base64_encode(const void* buf, size_t size)
 {
-	static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-
-	char* str = (char*) malloc((size+3)*4/3 + 1);
-
-	char* p = str;
-	const unsigned char* q = (const unsigned char*) buf;
-	size_t i = 0;
+	char* str = (char*) malloc(BASE64_LENGTH(size) + 1);
 
 	if (str == NULL) {
 		return NULL;
 	}
 
-	while (i < size) {
-		int c = q[i++];
-		c *= 256;
-		if (i < size)
-            c += q[i];
-		i++;
-
-		c *= 256;
-		if (i < size)
-            c += q[i];
-		i++;
-
-		*p++ = base64[(c & 0x00fc0000) >> 18];
-		*p++ = base64[(c & 0x0003f000) >> 12];
-
-		if (i > size + 1)
-			*p++ = '=';
-		else
-			*p++ = base64[(c & 0x00000fc0) >> 6];
-
-		if (i > size)
-			*p++ = '=';
-		else
-			*p++ = base64[c & 0x0000003f];
-	}
-
-	*p = 0;
+	str[base64_encode_into(buf, size, str)] = 0;
 
 	return str;
 }
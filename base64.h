@@ -3,7 +3,11 @@
 
 #include <stddef.h>
 
+/* characters needed to encode `n' bytes, without the null-terminator */
+#define BASE64_LENGTH(n)	(((n) + 2) / 3 * 4)
+
 char* base64_encode(const void* buf, size_t size);
+size_t base64_encode_into(const void* buf, size_t size, char* out);
 void* base64_decode(const char* s, size_t *data_len);
 
 #endif
@@ -11,6 +11,20 @@
 #if !defined(WIN32) && !defined(_AIX)
 # include <err.h>
 #endif
+#include <errno.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+# include <signal.h>
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <sys/wait.h>
+#endif
+#if HAVE_MMAP
+# include <sys/mman.h>
+#endif
+#if HAVE_PTHREAD_CREATE
+# include <pthread.h>
+#endif
 #include "json.h"
 #include "base64.h"
 
@@ -39,12 +53,20 @@
 #define FLAG_BOOLEAN	0x08
 #define FLAG_NOSTDIN	0x10
 #define FLAG_SKIPNULLS	0x20
-#define FLAG_MASK	(FLAG_ARRAY | FLAG_PRETTY | FLAG_NOBOOL | FLAG_BOOLEAN | FLAG_NOSTDIN | FLAG_SKIPNULLS)
+#define FLAG_RECORDS	0x40
+#define FLAG_MASK	(FLAG_ARRAY | FLAG_PRETTY | FLAG_NOBOOL | FLAG_BOOLEAN | FLAG_NOSTDIN | FLAG_SKIPNULLS | FLAG_RECORDS)
+
+/* Indentation of pretty output, one copy per level; set by -i */
+const char *spacer = SPACER;
 
 /* Size of buffer blocks for pipe slurping */
 #define SLURP_BLOCK_SIZE 4096
 
-static JsonNode *pile;		/* pile of nested objects/arrays */
+/* Size of the blocks read for words on stdin */
+#define READ_BLOCK_SIZE (64 * 1024)
+
+/* Size of the batches of records handed to each worker with -r -j */
+#define RECORD_BATCH_SIZE (256 * 1024)
 
 #if defined(_WIN32) || defined(_AIX)
 #include <errno.h>
@@ -90,68 +112,61 @@ JsonTag flags_to_tag(int flags) {
 	return flags / (FLAG_MASK + 1);
 }
 
-void json_copy_to_object(JsonNode * obj, JsonNode * object_or_array, int clobber)
-{
-	JsonNode *node, *node_child, *obj_child;
+/*
+ * Files read while building a document (@file, %file, :file, key:=file)
+ * are kept until the document has been written, so that the nodes made
+ * from them can refer to their contents instead of copying them; other
+ * memory the nodes refer to can be adopted the same way. Regular files
+ * are mapped where possible; anything else is read.
+ */
 
-	if (obj->tag != JSON_OBJECT && obj->tag != JSON_ARRAY)
-		return;
+typedef struct Slurped {
+	struct Slurped *next;
+	char *buf;
+	size_t maplen;		/* 0 if buf is malloc()ed */
+	FILE *fp;		/* closed with the document, if not NULL */
+} Slurped;
 
-	json_foreach(node, object_or_array) {
-		if (!clobber & (json_find_member(obj, node->key) != NULL))
-			continue;	/* Don't clobber existing keys */
-		if (obj->tag == JSON_OBJECT) {
-			if (node->tag == JSON_STRING)
-				json_append_member(obj, node->key, json_mkstring(node->string_));
-			else if (node->tag == JSON_NUMBER)
-				json_append_member(obj, node->key, json_mknumber(node->number_));
-			else if (node->tag == JSON_BOOL)
-				json_append_member(obj, node->key, json_mkbool(node->bool_));
-			else if (node->tag == JSON_NULL)
-				json_append_member(obj, node->key, json_mknull());
-			else if (node->tag == JSON_OBJECT) {
-				/* Deep-copy existing object to new object */
-				json_append_member(obj, node->key, (obj_child = json_mkobject()));
-				json_foreach(node_child, node) {
-					json_copy_to_object(obj_child, node_child, clobber);
-				}
-			} else
-				fprintf(stderr, "PANIC: unhandled JSON type %d\n", node->tag);
-		} else if (obj->tag == JSON_ARRAY) {
-			if (node->tag == JSON_STRING)
-				json_append_element(obj, json_mkstring(node->string_));
-			if (node->tag == JSON_NUMBER)
-				json_append_element(obj, json_mknumber(node->number_));
-			if (node->tag == JSON_BOOL)
-				json_append_element(obj, json_mkbool(node->bool_));
-			if (node->tag == JSON_NULL)
-				json_append_element(obj, json_mknull());
-		}
-	}
-}
+static Slurped *slurped;	/* most recent first */
+static int slurped_files;	/* how many have a fp */
+
+/* Files kept open with a document at most, so as not to run out */
+#define SLURPED_FILES_MAX 64
 
-int slurp(FILE *fp, char **bufp, off_t bufblk_sz, int eos_char, size_t *out_len, bool fold_newlines)
+int slurp(FILE *fp, char **bufp, off_t bufblk_sz, size_t *out_len, bool fold_newlines)
 {
-	char *buf;
+	char *buf, *nbuf;
 	int result = 0;
-	size_t i = 0;
-	int ch = EOF;
+	size_t i = 0, n, j;
 	size_t buffer_len = bufblk_sz;
 
 	if ((buf = malloc(buffer_len)) == NULL) {
 		result = -1;
 	} else {
-		while ((ch = fgetc(fp)) != eos_char && ch != EOF) {
+		for (;;) {
+			/* Grow before reading, so that a full buffer is never
+			   mistaken for the end of the file */
 			if (i == (buffer_len - 1)) {
-				buffer_len += bufblk_sz;
-				if ((buf = realloc(buf, buffer_len)) == NULL) {
+				buffer_len *= 2;
+				if ((nbuf = realloc(buf, buffer_len)) == NULL) {
 					result = -1;
 					break;
 				}
+				buf = nbuf;
+			}
+			if ((n = fread(buf + i, 1, buffer_len - 1 - i, fp)) == 0) {
+				break;
 			}
-			if (ch != '\n' || !fold_newlines) {
-				buf[i++] = ch;
+			if (fold_newlines) {
+				char *p = buf + i, *q = p;
+
+				for (j = 0; j < n; j++) {
+					if (p[j] != '\n')
+						*q++ = p[j];
+				}
+				n = q - p;
 			}
+			i += n;
 		}
 	}
 	if (result < 0) {
@@ -165,11 +180,76 @@ int slurp(FILE *fp, char **bufp, off_t bufblk_sz, int eos_char, size_t *out_len,
 	return result;
 }
 
+/*
+ * Have `buf' (mapped if `maplen' isn't 0) released with the document.
+ */
+
+void slurp_adopt(char *buf, size_t maplen)
+{
+	Slurped *s;
+
+	if ((s = malloc(sizeof(Slurped))) == NULL) {
+		errx(1, "Cannot allocate memory");
+	}
+	s->buf = buf;
+	s->maplen = maplen;
+	s->fp = NULL;
+	s->next = slurped;
+	slurped = s;
+}
+
+/*
+ * Release `buf' (mapped if `maplen' isn't 0) right away.
+ */
+
+void slurp_free(char *buf, size_t maplen)
+{
+#if HAVE_MMAP
+	if (maplen > 0)
+		munmap(buf, maplen);
+	else
+#else
+	(void)maplen;
+#endif
+	free(buf);
+}
+
+#if HAVE_MMAP
+/*
+ * Map the regular file open on `fd' privately, followed by a zero-filled
+ * page so that the contents are NUL-terminated. Returns NULL if the file
+ * cannot be mapped.
+ */
+
+char *map_file(int fd, size_t size, size_t *maplen)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	char *base;
+
+	/* Reserve room for the file plus at least one trailing NUL ... */
+	*maplen = (size / pagesize + 1) * pagesize;
+	base = mmap(NULL, *maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) {
+		return (NULL);
+	}
+	/* ... and lay the file over the start of it */
+	if (size > 0 && mmap(base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(base, *maplen);
+		return (NULL);
+	}
+#if HAVE_MADVISE
+	madvise(base, size, MADV_SEQUENTIAL);
+#endif
+	return (base);
+}
+#endif
+
 char *slurp_file(const char* filename, size_t *out_len, bool fold_newlines)
 {
-	char *buf;
+	char *buf = NULL;
 	off_t buffer_len;
 	FILE *fp;
+	size_t maplen = 0;
 	bool use_stdin = strcmp(filename, "-") == 0;
 
 	if (use_stdin) fp = stdin;
@@ -185,23 +265,419 @@ char *slurp_file(const char* filename, size_t *out_len, bool fold_newlines)
 	} else {
 		buffer_len = ftello(fp) + 1;
 		fseeko(fp, 0, SEEK_SET);
+		/* Files such as those in /proc say they are empty */
+		if (buffer_len == 1)
+			buffer_len = SLURP_BLOCK_SIZE;
+	}
+#if HAVE_MMAP
+	struct stat st;
+
+	if (!fold_newlines && fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) &&
+	    st.st_size > 0 && (buf = map_file(fileno(fp), st.st_size, &maplen)) != NULL) {
+		*out_len = st.st_size;
 	}
+#endif
 
-	if (slurp(fp, &buf, buffer_len, EOF, out_len, fold_newlines) < 0) {
+	if (buf == NULL && slurp(fp, &buf, buffer_len, out_len, fold_newlines) < 0) {
 		errx(1, "File %s is too large to be read into memory", filename);
 	}
 	if (!use_stdin) fclose(fp);
+
+	slurp_adopt(buf, maplen);
 	return buf;
 }
 
-char *slurp_line(FILE *fp, size_t *out_len)
+/*
+ * Release the files read for the document just written.
+ */
+
+void slurp_release(void)
+{
+	Slurped *s;
+
+	while ((s = slurped) != NULL) {
+		slurped = s->next;
+		slurp_free(s->buf, s->maplen);
+		if (s->fp != NULL) {
+			fclose(s->fp);
+			slurped_files--;
+		}
+		free(s);
+	}
+}
+
+/*
+ * A %file value of a regular file is base64-encoded only while the
+ * document is written, a chunk at a time, so that it takes the same
+ * memory whatever the size of the file. The file is kept open from when
+ * its word is added, so what is written is what was there then, and
+ * only as long as it was then.
+ */
+
+typedef struct {
+	FILE *fp;
+	off_t size;		/* at the time the word was added */
+	off_t pos;
+	bool done;		/* the last chunk has been returned */
+	char filename[];
+} LazyFile;
+
+/* Bytes of input encoded at a time; a multiple of 3 */
+#define BASE64_CHUNK_SIZE (16 * 1024 * 3)
+
+long read_base64(void *ctx, char *buf, size_t size)
+{
+	LazyFile *lf = ctx;
+	unsigned char in[BASE64_CHUNK_SIZE];
+	size_t n = size / 4 * 3, got;
+
+	if (lf->done) {
+		/* Start over next time */
+		lf->done = false;
+		lf->pos = 0;
+		if (fseeko(lf->fp, 0, SEEK_SET) != 0) {
+			err(1, "Cannot read %s", lf->filename);
+		}
+		return (0);
+	}
+	if (n > sizeof(in))
+		n = sizeof(in);
+	if ((off_t)n > lf->size - lf->pos)
+		n = lf->size - lf->pos;
+	if ((got = fread(in, 1, n, lf->fp)) < n) {
+		if (ferror(lf->fp)) {
+			err(1, "Cannot read %s", lf->filename);
+		}
+		errx(1, "File %s was truncated while being read", lf->filename);
+	}
+	lf->pos += got;
+	lf->done = (lf->pos == lf->size);
+	return (base64_encode_into(in, got, buf));
+}
+
+/*
+ * Return a lazy base64 string for `filename', or NULL if it isn't a
+ * regular file that says how large it is (or too many are open already)
+ * and must be read now.
+ */
+
+JsonNode *lazy_base64(const char *filename)
+{
+	LazyFile *lf;
+	struct stat st;
+	FILE *fp;
+
+	if (strcmp(filename, "-") == 0 || slurped_files >= SLURPED_FILES_MAX) {
+		return (NULL);
+	}
+	/* Don't open a FIFO twice, nor trust the size of a file in /proc */
+	if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		return (NULL);
+	}
+	if ((fp = fopen(filename, "rb")) == NULL) {
+		perror(filename);
+		errx(1, "Cannot open %s for reading", filename);
+	}
+	if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		fclose(fp);
+		return (NULL);
+	}
+
+	if ((lf = malloc(sizeof(LazyFile) + strlen(filename) + 1)) == NULL) {
+		errx(1, "Cannot allocate memory");
+	}
+	lf->fp = fp;
+	lf->size = st.st_size;
+	lf->pos = 0;
+	lf->done = false;
+	strcpy(lf->filename, filename);
+	slurp_adopt((char *)lf, 0);
+	slurped->fp = fp;
+	slurped_files++;
+	return (json_mkstring_lazy(read_base64, lf));
+}
+
+/*
+ * Prefetching: with -j, the files named by words (@file, :file and
+ * key:=file) are read, and checked as JSON, by a pool of threads before
+ * any word is added; the words then pick up the results in order. A file
+ * a worker couldn't handle is left for its word to read, and fail at, as
+ * usual. Only regular files are prefetched, and %file words are left
+ * alone, since their files are encoded a chunk at a time as they are
+ * written (see lazy_base64).
+ */
+
+typedef struct {
+	const char *filename;
+	char kind;		/* '@' or ':' */
+	bool taken;		/* handed to a word */
+	bool valid;		/* ':' contents passed json_validate */
+	char *buf;		/* NULL if not prefetched */
+	size_t len;
+	size_t maplen;		/* 0 if buf is malloc()ed */
+} Prefetch;
+
+static Prefetch *prefetches;
+static size_t nprefetches, prefetch_next, prefetch_taken;
+
+#if HAVE_PTHREAD_CREATE
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * Read, and check if need be, the file of `pf'; runs in a worker thread,
+ * so it must leave everything but `pf' alone and never exit.
+ */
+
+void prefetch_file(Prefetch *pf)
+{
+	struct stat st;
+	FILE *fp;
+	char *buf = NULL;
+	size_t len = 0, maplen = 0;
+
+	/* Don't block opening a FIFO nobody writes to */
+	if (stat(pf->filename, &st) != 0 || !S_ISREG(st.st_mode)) {
+		return;
+	}
+	if ((fp = fopen(pf->filename, "r")) == NULL) {
+		return;
+	}
+	if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode)) {
+		fclose(fp);
+		return;
+	}
+#if HAVE_MMAP
+	if (st.st_size > 0 && (buf = map_file(fileno(fp), st.st_size, &maplen)) != NULL) {
+		len = st.st_size;
+	}
+#endif
+	if (buf == NULL && slurp(fp, &buf, st.st_size + 1, &len, false) < 0) {
+		fclose(fp);
+		return;
+	}
+	fclose(fp);
+
+	if (pf->kind == ':') {
+		pf->valid = json_validate(buf);
+	}
+	pf->len = len;
+	pf->maplen = maplen;
+	pf->buf = buf;
+}
+
+void *prefetch_worker(void *arg)
+{
+	size_t i;
+
+	(void)arg;
+	for (;;) {
+#if HAVE_PTHREAD_CREATE
+		pthread_mutex_lock(&prefetch_lock);
+#endif
+		i = prefetch_next++;
+#if HAVE_PTHREAD_CREATE
+		pthread_mutex_unlock(&prefetch_lock);
+#endif
+		if (i >= nprefetches) {
+			return (NULL);
+		}
+		prefetch_file(&prefetches[i]);
+	}
+}
+
+/*
+ * Note the file `kv' names, if any, the same way the word will be read.
+ */
+
+void prefetch_word(char *kv, int flags)
+{
+	char *p = strchr(kv, '='), *r = strchr(kv, ':'), *value;
+	Prefetch *pf;
+
+	if (flags & FLAG_ARRAY) {
+		value = kv;
+	} else if (r && r[1] == '=' && !strchr(kv, '@')) {
+		value = p;	/* key:=file reads like :file */
+	} else if (p != NULL) {
+		value = p + 1;
+	} else {
+		return;
+	}
+	if (value != p && *value != '@' && *value != ':') {
+		return;
+	}
+	if (value[1] == 0 || strcmp(value + 1, "-") == 0) {
+		return;
+	}
+	pf = &prefetches[nprefetches++];
+	pf->kind = (value == p) ? ':' : *value;
+	pf->filename = value + 1;
+}
+
+/*
+ * Prefetch the files named by the `count' `words' with `jobs' threads, the calling
+ * one included.
+ */
+
+void prefetch(char **words, int count, int flags, int jobs)
+{
+#if HAVE_PTHREAD_CREATE
+	pthread_t *threads;
+	int i, n = 0;
+
+	if ((prefetches = calloc(count, sizeof(Prefetch))) == NULL ||
+	    (threads = calloc(jobs, sizeof(pthread_t))) == NULL) {
+		errx(1, "Cannot allocate memory");
+	}
+	for (i = 0; i < count; i++) {
+		prefetch_word(words[i], flags);
+	}
+	while (n < jobs - 1 && (size_t)n + 1 < nprefetches &&
+	       pthread_create(&threads[n], NULL, prefetch_worker, NULL) == 0) {
+		n++;
+	}
+	prefetch_worker(NULL);
+	while (n > 0) {
+		pthread_join(threads[--n], NULL);
+	}
+	free(threads);
+#else
+	(void)words, (void)count, (void)flags, (void)jobs;
+#endif
+}
+
+/*
+ * Return the prefetched `kind' file `filename' for the word being added,
+ * or NULL if it must be read now. Its contents are released with the
+ * document, like those of slurp_file.
+ */
+
+Prefetch *prefetched(char kind, const char *filename)
 {
+	size_t i;
+
+	for (i = prefetch_taken; i < nprefetches; i++) {
+		Prefetch *pf = &prefetches[i];
+
+		if (!pf->taken && pf->kind == kind && strcmp(pf->filename, filename) == 0) {
+			pf->taken = true;
+			prefetch_taken = i + 1;
+			if (pf->buf == NULL) {
+				return (NULL);
+			}
+			slurp_adopt(pf->buf, pf->maplen);
+			return (pf);
+		}
+	}
+	return (NULL);
+}
+
+/*
+ * Release whatever was prefetched but not used.
+ */
+
+void prefetch_free(void)
+{
+	size_t i;
+
+	for (i = 0; i < nprefetches; i++) {
+		if (!prefetches[i].taken && prefetches[i].buf != NULL) {
+			slurp_free(prefetches[i].buf, prefetches[i].maplen);
+		}
+	}
+	free(prefetches);
+	prefetches = NULL;
+	nprefetches = prefetch_next = prefetch_taken = 0;
+}
+
+/*
+ * Line reader: reads a file descriptor in large blocks and hands out
+ * lines in place, NUL-terminated, reusing one buffer throughout. A line
+ * ends at a newline (dropping a preceding carriage return) or at a NUL.
+ */
+
+typedef struct {
+	int fd;
 	char *buf;
+	size_t size;		/* allocated, less room for a NUL */
+	size_t pos;		/* start of the next line */
+	size_t len;		/* bytes in buf */
+	bool eof;
+} LineReader;
 
-	if (slurp(fp, &buf, SLURP_BLOCK_SIZE, '\n', out_len, false) < 0) {
-		errx(1, "Line too large to be read into memory");
+void reader_init(LineReader *r, int fd)
+{
+	r->fd = fd;
+	r->size = READ_BLOCK_SIZE;
+	if ((r->buf = malloc(r->size + 1)) == NULL) {
+		errx(1, "Cannot allocate input buffer");
+	}
+	r->pos = r->len = 0;
+	r->eof = false;
+}
+
+void reader_free(LineReader *r)
+{
+	free(r->buf);
+}
+
+/*
+ * Return the next line and its length in `*len', or NULL at the end of
+ * input. `*eol' receives the character that ended the line: '\n', '\0',
+ * or EOF for a last line without either. The line stays valid (and may
+ * be modified) until the next call.
+ */
+
+char *reader_next(LineReader *r, size_t *len, int *eol)
+{
+	char *line, *end, *nl, *nul;
+	ssize_t n;
+
+	for (;;) {
+		line = r->buf + r->pos;
+		end = r->buf + r->len;
+		nl = memchr(line, '\n', end - line);
+		if ((nul = memchr(line, '\0', (nl ? nl : end) - line)) != NULL) {
+			nl = nul;
+		}
+		if (nl == NULL && r->eof) {
+			if (line == end) {
+				return (NULL);
+			}
+			nl = end;	/* there's always room for the NUL */
+		}
+		if (nl != NULL) {
+			*eol = (nl == end) ? EOF : *nl;
+			*nl = 0;
+			*len = nl - line;
+			if (*eol != '\0' && *len > 0 && line[*len - 1] == '\r') {
+				line[--*len] = 0;
+			}
+			r->pos = (nl == end) ? r->len : (size_t)(nl + 1 - r->buf);
+			return (line);
+		}
+
+		/* Need more: keep the partial line and refill the block */
+		r->len -= r->pos;
+		memmove(r->buf, line, r->len);
+		r->pos = 0;
+		if (r->len == r->size) {
+			r->size *= 2;
+			if ((r->buf = realloc(r->buf, r->size + 1)) == NULL) {
+				errx(1, "Line too large to be read into memory");
+			}
+		}
+		while ((n = read(r->fd, r->buf + r->len, r->size - r->len)) == -1 && errno == EINTR)
+			;
+		if (n == -1) {
+			err(1, "Cannot read input");
+		}
+		if (n == 0) {
+			r->eof = true;
+		}
+		r->len += n;
 	}
-	return buf;
 }
 
 JsonNode *jo_mknull(JsonTag type) {
@@ -251,9 +727,8 @@ JsonNode *jo_mkstring(char *str, JsonTag type) {
 	}
 }
 
-JsonNode *jo_mknumber(char *str, JsonTag type) {
+JsonNode *jo_mknumber(char *str, JsonTag type, bool as_written) {
 	/* ASSUMPTION: str already tested as valid number */
-	double n = strtod(str, NULL);
 
 	switch (type) {
 		case JSON_STRING:
@@ -261,11 +736,13 @@ JsonNode *jo_mknumber(char *str, JsonTag type) {
 			return json_mkstring(str);
 			break;
 		case JSON_BOOL:
-			return json_mkbool(n != 0);
+			return json_mkbool(strtod(str, NULL) != 0);
 			break;
 		default:
-			/* ASSUMPTION: str already tested as valid number */
-			return json_mknumber(n);
+			/* JSON numbers are kept as written; others (0x1F, .5, +1) are converted */
+			if (as_written)
+				return json_mknumber_text(str);
+			return json_mknumber(strtod(str, NULL));
 			break;
 	}
 }
@@ -296,11 +773,16 @@ JsonNode *vnode(char *str, int flags)
 		return jo_mkstring(str, type);
 	}
 
-	char *endptr;
-	double num = strtod(str, &endptr);
+	if (json_validate_number(str)) {
+		return jo_mknumber(str, type, true);
+	} else {
+		/* Anything else strtod(3) reads completely and finitely */
+		char *endptr;
+		double num = strtod(str, &endptr);
 
-	if (!*endptr && isfinite(num)) {
-		return jo_mknumber(str, type);
+		if (!*endptr && isfinite(num)) {
+			return jo_mknumber(str, type, false);
+		}
 	}
 
 	if (!(flags & FLAG_NOBOOL)) {
@@ -322,9 +804,18 @@ JsonNode *vnode(char *str, int flags)
 			bool jsonmode = (*str == ':');
 			size_t len = 0;
 			JsonNode *j = NULL;
+			Prefetch *pf = binmode ? NULL : prefetched(*str, filename);
 	
-			if ((content = slurp_file(filename, &len, false)) == NULL) {
-				errx(1, "Error reading file %s", filename);
+			if (pf != NULL) {
+				content = pf->buf;
+				len = pf->len;
+			} else {
+				if (binmode && (j = lazy_base64(filename)) != NULL) {
+					return (j);
+				}
+				if ((content = slurp_file(filename, &len, false)) == NULL) {
+					errx(1, "Error reading file %s", filename);
+				}
 			}
 	
 			if (binmode) {
@@ -337,7 +828,11 @@ JsonNode *vnode(char *str, int flags)
 				j = json_mkstring(encoded);
 				free(encoded);
 			} else if (jsonmode) {
-				j = json_decode(content);
+				if (pf != NULL && pf->valid) {
+					j = json_decode_raw_checked(content);
+				} else {
+					j = json_decode_raw_ref(content);
+				}
 				if (j == NULL) {
 					errx(1, "Cannot decode JSON in file %s", filename);
 				}
@@ -345,13 +840,12 @@ JsonNode *vnode(char *str, int flags)
 	
 			// If it got this far without valid JSON, just consider it a string
 			if (j == NULL) {
-				char *bp = content + strlen(content) - 1;
+				len = strlen(content);
 	
-				if (*bp == '\n') *bp-- = 0;
-				if (*bp == '\r') *bp = 0;
-				j = json_mkstring(content);
+				if (len > 0 && content[len - 1] == '\n') content[--len] = 0;
+				if (len > 0 && content[len - 1] == '\r') content[--len] = 0;
+				j = json_mkstring_ref(content);
 			}
-			free(content);
 			return (j);
 		}
 	}
@@ -360,7 +854,7 @@ JsonNode *vnode(char *str, int flags)
 		if (type == JSON_STRING) {
 			return json_mkstring(str);
 		}
-		JsonNode *obj = json_decode(str);
+		JsonNode *obj = json_decode_raw(str);
 
 		if (obj == NULL) {
 			/* JSON cannot be decoded; return the string */
@@ -393,21 +887,55 @@ JsonNode *boolnode(char *str)
 	return json_mkbool(atoi(str));
 }
 
+/*
+ * Turn the argument of -i, a number of spaces or `t' for a tab, into
+ * the string pretty output is indented with per level.
+ */
+
+const char *indentation(const char *arg)
+{
+	char *end, *space;
+	long width;
+
+	if (strcmp(arg, "t") == 0) {
+		return ("\t");
+	}
+
+	width = strtol(arg, &end, 10);
+	if (end == arg || *end != 0 || width < 0 || width > 64) {
+		errx(1, "Invalid indentation %s: give a number of spaces up to 64, or t", arg);
+	}
+	if ((space = malloc(width + 1)) == NULL) {
+		errx(1, "Cannot allocate memory");
+	}
+	memset(space, ' ', width);
+	space[width] = 0;
+	return (space);
+}
+
 int usage(char *prog)
 {
-	fprintf(stderr, "Usage: %s [-a] [-B] [-D] [-d keydelim] [-p] [-e] [-n] [-o outfile] [-v] [-V] [-f file] [--] [-s|-n|-b] [word...]\n", prog);
+	fprintf(stderr, "Usage: %s [-a] [-B] [-D] [-d keydelim] [-p] [-i indent] [-j N] [-0] [-A file] [-e] [-n] [-r] [-c] [-u socket] [-o outfile] [-v] [-V] [-f file] [-m file] [--] [-s|-n|-b] [word...]\n", prog);
 	fprintf(stderr, "\tword is key=value or key@value\n");
 	fprintf(stderr, "\t-a creates an array of words\n");
 	fprintf(stderr, "\t-B disable boolean true/false/null detection\n");
 	fprintf(stderr, "\t-D deduplicate object keys\n");
 	fprintf(stderr, "\t-d key will be object path separated by keydelim\n");
 	fprintf(stderr, "\t-f load file as JSON object or array\n");
+	fprintf(stderr, "\t-m apply file to the document as a JSON merge patch (RFC 7396)\n");
 	fprintf(stderr, "\t-p pretty-prints JSON on output\n");
+	fprintf(stderr, "\t-i pretty-prints JSON indented by indent spaces, or by tabs if indent is t\n");
+	fprintf(stderr, "\t-j read files named by words with N threads, or records with N processes\n");
+	fprintf(stderr, "\t-A read NUL-terminated words from file before any others\n");
+	fprintf(stderr, "\t-0 read NUL-terminated words from stdin, like -A -\n");
 	fprintf(stderr, "\t-e quit if stdin is empty do not wait for input\n");
 	fprintf(stderr, "\t-s coerce type guessing to string\n");
 	fprintf(stderr, "\t-b coerce type guessing to bool\n");
 	fprintf(stderr, "\t-n coerce type guessing to number\n");
 	fprintf(stderr, "\t-o output to the given file\n");
+	fprintf(stderr, "\t-r read records of words from stdin, print one document per record\n");
+	fprintf(stderr, "\t-c answer requests of words on stdin and stdout (coprocess)\n");
+	fprintf(stderr, "\t-u answer requests of words on the given Unix-domain socket\n");
 	fprintf(stderr, "\t-v show version\n");
 	fprintf(stderr, "\t-V show version in JSON\n");
 
@@ -497,13 +1025,20 @@ int member_to_object(JsonNode *object, int flags, char key_delim, char *kv)
 		char *filename = p + 1;
 		char *content;
 		size_t len;
+		Prefetch *pf = prefetched(':', filename);
+		JsonNode *o;
 
-		if ((content = slurp_file(filename, &len, false)) == NULL) {
+		if (pf != NULL) {
+			content = pf->buf;
+		} else if ((content = slurp_file(filename, &len, false)) == NULL) {
 			errx(1, "Error reading file %s", filename);
 		}
 
-		JsonNode *o = json_decode(content);
-		free(content);
+		if (pf != NULL && pf->valid) {
+			o = json_decode_raw_checked(content);
+		} else {
+			o = json_decode_raw_ref(content);
+		}
 
 		if (o == NULL) {
 			errx(1, "Cannot decode JSON in file %s", filename);
@@ -630,9 +1165,574 @@ char *stringify(JsonNode *json, int flags)
 {
 	int pretty = flags & FLAG_PRETTY;
 
-	return json_stringify(json, (pretty) ? SPACER : NULL);
+	return json_stringify(json, (pretty) ? spacer : NULL);
 }
 
+/*
+ * Add a word as given on the command line to `json'. Words -s, -n
+ * and -b set a one-shot type coercion for the word that follows.
+ */
+
+void add_word(JsonNode *json, int *flags, char key_delim, char *kv)
+{
+	char *p;
+
+	if (kv[0] == '-' && !(*flags & COERCE_MASK)) {
+		/* Set one-shot coerce flag */
+		switch (kv[1]) {
+			case 'b':
+				*flags |= TAG_FLAG_BOOL;
+				return;
+			case 's':
+				*flags |= TAG_FLAG_STRING;
+				return;
+			case 'n':
+				*flags |= TAG_FLAG_NUMBER;
+				return;
+			default:
+				/* Treat as normal input */
+				break;
+		}
+	}
+	p = utf8_from_locale(kv, -1);
+	append_kv(json, *flags, key_delim, p);
+	utf8_free(p);
+	/* Reset any one-shot coerce flags */
+	*flags &= ~(COERCE_MASK);
+}
+
+/*
+ * Print `json' followed by a newline on `out'. The document is streamed
+ * through a fixed-size buffer rather than built up in memory first,
+ * except on a Windows console where it needs converting as a whole.
+ */
+
+void print_json(FILE *out, JsonNode *json, int flags, int ttyout)
+{
+#ifdef _WIN32
+	if (ttyout) {
+		char *js_string = stringify(json, flags);
+		char *p;
+
+		if (js_string == NULL) {
+			errx(1, "Cannot write output");
+		}
+		p = locale_from_utf8(js_string, -1);
+		fprintf(out, "%s\n", p);
+		locale_free(p);
+		free(js_string);
+		return;
+	}
+#else
+	(void)ttyout;
+#endif
+	if (!json_write(out, json, (flags & FLAG_PRETTY) ? spacer : NULL) ||
+	    putc('\n', out) == EOF) {
+		err(1, "Cannot write output");
+	}
+}
+
+FILE *open_output(const char *out_file, int *ttyout)
+{
+	FILE *out = fopen(out_file, "w");
+
+	if (out == NULL) {
+		perror(out_file);
+		errx(1, "Cannot open %s for writing", out_file);
+	}
+	*ttyout = isatty(fileno(out));
+	return (out);
+}
+
+/*
+ * Start a new document: the JSON loaded with -f (and -m), passed in
+ * `in_tape', or else an empty array or object.
+ */
+
+JsonNode *new_document(const JsonTape *in_tape, int *flags)
+{
+	JsonNode *json = NULL;
+
+	if (in_tape != NULL && (json = json_tape_node(in_tape, JSON_TAPE_ROOT)) != NULL) {
+		switch (json->tag) {
+			case JSON_ARRAY:
+				*flags |= FLAG_ARRAY;
+				break;
+			case JSON_OBJECT:
+				break;
+			default:
+				errx(1, "Input JSON not an array or object: %s", stringify(json, *flags));
+		}
+	}
+	if (json == NULL) {
+		json = (*flags & FLAG_ARRAY) ? json_mkarray() : json_mkobject();
+	}
+	return (json);
+}
+
+/*
+ * Return the words in `filename' (- for stdin), each ended by a NUL,
+ * followed by the `*argc' words of `argv', in a vector like argv; `*argc'
+ * becomes the number of words. The words are left where they are in the
+ * file's contents, which are kept with the document.
+ */
+
+char **read_words(const char *filename, char **argv, int *argc)
+{
+	char *buf, *p, *end, **words;
+	size_t len, n = 0;
+	int i;
+
+	if ((buf = slurp_file(filename, &len, false)) == NULL) {
+		errx(1, "Error reading file %s", filename);
+	}
+	end = buf + len;
+	for (p = buf; p < end; p += strlen(p) + 1) {
+		n++;
+	}
+	if ((words = calloc(n + *argc + 1, sizeof(char *))) == NULL) {
+		errx(1, "Cannot allocate memory");
+	}
+	for (n = 0, p = buf; p < end; p += strlen(p) + 1) {
+		words[n++] = p;
+	}
+	for (i = 0; i < *argc; i++) {
+		words[n++] = argv[i];
+	}
+	*argc = n;
+	return (words);
+}
+
+/*
+ * Apply the JSON in each of the `count' files to the document loaded
+ * with -f, if any, as a merge patch (RFC 7396), and return a tape of
+ * the result for every document to start from instead.
+ */
+
+JsonTape *merge_files(JsonTape *in_tape, char **files, int count, JsonArena *arena)
+{
+	JsonNode *json = NULL, *patch;
+	JsonTape *tape;
+	char *str;
+	size_t len;
+	int i;
+
+	if (in_tape != NULL) {
+		json = json_tape_node(in_tape, JSON_TAPE_ROOT);
+	}
+	for (i = 0; i < count; i++) {
+		if ((str = slurp_file(files[i], &len, false)) == NULL) {
+			errx(1, "Error reading file %s", files[i]);
+		}
+		/* Members the patch adds are moved over undecoded */
+		if ((patch = json_decode_raw_ref(str)) == NULL) {
+			errx(1, "Cannot decode JSON in file %s", files[i]);
+		}
+		json = json_merge_patch(json, patch);
+	}
+
+	/* The tape copies what the tree borrows from the files and in_tape */
+	tape = json_tape_from_node(json);
+	json_arena_reset(arena);
+	slurp_release();
+	json_tape_free(in_tape);
+	return (tape);
+}
+
+/*
+ * Print the record collected in `json', if any, and release it.
+ */
+
+JsonNode *end_record(JsonNode *json, int flags, FILE *out, int ttyout, JsonArena *arena)
+{
+	if (json != NULL) {
+		print_json(out, json, flags, ttyout);
+		json_arena_reset(arena);
+		slurp_release();
+	}
+	return (NULL);
+}
+
+/*
+ * Record-stream mode: read words from `reader', one per line, and print
+ * a compact document for every record. Records end at an empty line or
+ * a NUL byte. All per-record memory lives in `arena', which is reset
+ * after each record.
+ */
+
+void read_records(LineReader *reader, int flags, char key_delim, const JsonTape *in_tape,
+	     JsonArena *arena, FILE *out, int ttyin, int ttyout)
+{
+	JsonNode *json = NULL;
+	char *line, *kv;
+	size_t len;
+	int eol;
+
+	flags &= ~FLAG_PRETTY;
+	while ((line = reader_next(reader, &len, &eol)) != NULL) {
+		if (len > 0) {
+			if (json == NULL)
+				json = new_document(in_tape, &flags);
+			kv = ttyin ? utf8_from_locale(line, len) : line;
+			append_kv(json, flags, key_delim, kv);
+			if (ttyin) utf8_free(kv);
+		}
+		if (len == 0 || eol == '\0') {
+			json = end_record(json, flags, out, ttyout, arena);
+		}
+	}
+	end_record(json, flags, out, ttyout, arena);
+}
+
+#ifndef _WIN32
+/*
+ * Parallel records: with -j, the input is cut into batches of whole
+ * records, which a pool of worker processes turns into documents, each
+ * worker a batch at a time; their output is copied to `out' in the
+ * order of the input. A batch goes to the workers in turn, and a worker
+ * only gets its next batch once its last one has been copied, so no
+ * more than one batch per worker is ever in flight.
+ */
+
+typedef struct {
+	pid_t pid;
+	int to;			/* batches: length, then the records */
+	int from;		/* documents, then a NUL */
+	bool busy;		/* owes us the documents of a batch */
+} RecordWorker;
+
+bool read_fully(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = read(fd, p, len)) == -1 && errno == EINTR)
+			continue;
+		if (n == -1) {
+			err(1, "Cannot read input");
+		}
+		if (n == 0) {
+			return (false);
+		}
+		p += n;
+		len -= n;
+	}
+	return (true);
+}
+
+void write_fully(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, p, len)) == -1 && errno == EINTR)
+			continue;
+		if (n == -1) {
+			err(1, "Cannot write to worker");
+		}
+		p += n;
+		len -= n;
+	}
+}
+
+/*
+ * Return the length of the longest prefix of `buf' that is made of whole
+ * records, or 0 if there is none. `buf' starts at the start of a line.
+ */
+
+size_t record_cut(const char *buf, size_t len)
+{
+	size_t i;
+
+#define LINE_START(i)	((i) == 0 || buf[(i) - 1] == '\n' || buf[(i) - 1] == '\0')
+	for (i = len; i > 0; i--) {
+		if (buf[i - 1] == '\0') {
+			return (i);
+		}
+		/* An empty line ends at buf[i - 1] */
+		if (buf[i - 1] == '\n' &&
+		    (LINE_START(i - 1) || (i > 1 && buf[i - 2] == '\r' && LINE_START(i - 2)))) {
+			return (i);
+		}
+	}
+#undef LINE_START
+	return (0);
+}
+
+/*
+ * A worker: read batches from `to' and write their documents, each
+ * batch's followed by a NUL, on `from'. Never returns.
+ */
+
+void record_worker(int to, int from, int flags, char key_delim, const JsonTape *in_tape,
+		   JsonArena *arena, int ttyin)
+{
+	LineReader reader;
+	FILE *out;
+	size_t len;
+
+	if ((out = fdopen(from, "w")) == NULL) {
+		err(1, "fdopen");
+	}
+	reader_init(&reader, to);
+	while (read_fully(to, &len, sizeof(len))) {
+		if (len > reader.size) {
+			reader.size = len;
+			if ((reader.buf = realloc(reader.buf, reader.size + 1)) == NULL) {
+				errx(1, "Cannot allocate input buffer");
+			}
+		}
+		if (!read_fully(to, reader.buf, len)) {
+			errx(1, "Short batch of records");
+		}
+		reader.pos = 0;
+		reader.len = len;
+		reader.eof = true;
+		read_records(&reader, flags, key_delim, in_tape, arena, out, ttyin, false);
+		putc('\0', out);
+		if (fflush(out) == EOF) {
+			err(1, "Cannot write output");
+		}
+	}
+	_exit(0);
+}
+
+/*
+ * Copy the documents `w' owes us to `out'. If the worker died instead
+ * (having said why), so do we, as jo would have at that record.
+ */
+
+void record_collect(RecordWorker *w, FILE *out)
+{
+	char buf[READ_BLOCK_SIZE], *nul;
+	ssize_t n;
+
+	while (w->busy) {
+		if ((n = read(w->from, buf, sizeof(buf))) == -1 && errno == EINTR)
+			continue;
+		if (n == -1) {
+			err(1, "Cannot read from worker");
+		}
+		if (n == 0) {
+			fflush(out);
+			exit(1);
+		}
+		if ((nul = memchr(buf, '\0', n)) != NULL) {
+			n = nul - buf;
+			w->busy = false;
+		}
+		if (fwrite(buf, 1, n, out) != (size_t)n) {
+			err(1, "Cannot write output");
+		}
+	}
+}
+
+void parallel_records(int in, int jobs, int flags, char key_delim, const JsonTape *in_tape,
+		      JsonArena *arena, FILE *out, int ttyin)
+{
+	RecordWorker *workers;
+	size_t size = RECORD_BATCH_SIZE, len = 0, cut;
+	bool eof = false;
+	int w, i, to[2], from[2], status;
+	ssize_t n;
+	char *buf;
+
+	if ((workers = calloc(jobs, sizeof(RecordWorker))) == NULL ||
+	    (buf = malloc(size)) == NULL) {
+		errx(1, "Cannot allocate memory");
+	}
+	for (w = 0; w < jobs; w++) {
+		if (pipe(to) == -1 || pipe(from) == -1) {
+			err(1, "pipe");
+		}
+		switch (workers[w].pid = fork()) {
+			case -1:
+				err(1, "fork");
+			case 0:
+				/* Keep only our own ends, so that the others see EOF */
+				for (i = 0; i < w; i++) {
+					close(workers[i].to);
+					close(workers[i].from);
+				}
+				close(to[1]);
+				close(from[0]);
+				close(in);
+				record_worker(to[0], from[1], flags, key_delim, in_tape, arena, ttyin);
+		}
+		close(to[0]);
+		close(from[1]);
+		workers[w].to = to[1];
+		workers[w].from = from[0];
+	}
+
+	w = 0;
+	while (!eof || len > 0) {
+		while (!eof && len < size) {
+			if ((n = read(in, buf + len, size - len)) == -1 && errno == EINTR)
+				continue;
+			if (n == -1) {
+				err(1, "Cannot read input");
+			}
+			eof = (n == 0);
+			len += n;
+		}
+		if ((cut = eof ? len : record_cut(buf, len)) == 0) {
+			/* A record larger than the buffer */
+			size *= 2;
+			if ((buf = realloc(buf, size)) == NULL) {
+				errx(1, "Record too large to be read into memory");
+			}
+			continue;
+		}
+		record_collect(&workers[w], out);
+		write_fully(workers[w].to, &cut, sizeof(cut));
+		write_fully(workers[w].to, buf, cut);
+		workers[w].busy = true;
+		memmove(buf, buf + cut, len - cut);
+		len -= cut;
+		w = (w + 1) % jobs;
+	}
+
+	/* Collect the rest, still in order */
+	for (i = 0; i < jobs; i++, w = (w + 1) % jobs) {
+		record_collect(&workers[w], out);
+	}
+	for (w = 0; w < jobs; w++) {
+		close(workers[w].to);
+		close(workers[w].from);
+		if (waitpid(workers[w].pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			errx(1, "Worker %d failed", w + 1);
+		}
+	}
+	free(buf);
+	free(workers);
+}
+#endif
+
+/*
+ * Read records from `in', with `jobs' worker processes if that's more
+ * than one.
+ */
+
+void records(int in, int jobs, int flags, char key_delim, const JsonTape *in_tape,
+	     JsonArena *arena, FILE *out, int ttyin, int ttyout)
+{
+	LineReader reader;
+
+#ifndef _WIN32
+	if (jobs > 1) {
+		parallel_records(in, jobs, flags, key_delim, in_tape, arena, out, ttyin);
+		return;
+	}
+#endif
+	reader_init(&reader, in);
+	read_records(&reader, flags, key_delim, in_tape, arena, out, ttyin, ttyout);
+	reader_free(&reader);
+}
+
+/*
+ * Coprocess mode: answer requests read from `in' on `out'. A request is
+ * a list of words, one per line, which is handled exactly like words on
+ * the command line; an empty line ends it. Every request gets a compact
+ * document on a line of its own, flushed right away.
+ */
+
+void serve(int in, FILE *out, int flags, char key_delim, const JsonTape *in_tape, JsonArena *arena)
+{
+	JsonNode *json = NULL;
+	LineReader reader;
+	int req_flags = flags, eol;
+	char *line;
+	size_t len;
+
+	flags &= ~FLAG_PRETTY;
+	reader_init(&reader, in);
+	while ((line = reader_next(&reader, &len, &eol)) != NULL) {
+		if (json == NULL) {
+			req_flags = flags;
+			json = new_document(in_tape, &req_flags);
+		}
+		if (len > 0) {
+			add_word(json, &req_flags, key_delim, line);
+		} else {
+			print_json(out, json, req_flags, false);
+			if (fflush(out) == EOF) {
+				err(1, "Cannot write output");
+			}
+			json_arena_reset(arena);
+			slurp_release();
+			json = NULL;
+		}
+	}
+	if (json != NULL) {
+		/* Answer a last request that lacks its empty line */
+		print_json(out, json, req_flags, false);
+	}
+	reader_free(&reader);
+}
+
+#ifndef _WIN32
+/*
+ * Serve requests on a Unix-domain socket at `path'. Each connection is
+ * handled by a child process speaking the coprocess protocol, so that
+ * a request which makes jo bail out only drops its own connection.
+ */
+
+void serve_socket(const char *path, int flags, char key_delim, const JsonTape *in_tape, JsonArena *arena)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int s, c;
+	FILE *out;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errx(1, "Socket path too long: %s", path);
+	}
+	strcpy(addr.sun_path, path);
+
+	/* Clear a stale socket, but nothing else */
+	if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(path);
+	}
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		err(1, "socket");
+	}
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		err(1, "Cannot bind to %s", path);
+	}
+	if (listen(s, SOMAXCONN) == -1) {
+		err(1, "listen");
+	}
+	signal(SIGCHLD, SIG_IGN);	/* no zombies */
+
+	for (;;) {
+		if ((c = accept(s, NULL, NULL)) == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			err(1, "accept");
+		}
+		switch (fork()) {
+			case -1:
+				perror("fork");
+				break;
+			case 0:
+				close(s);
+				if ((out = fdopen(c, "w")) == NULL) {
+					err(1, "fdopen");
+				}
+				serve(c, out, flags, key_delim, in_tape, arena);
+				fflush(out);
+				_exit(0);
+		}
+		close(c);
+	}
+}
+#endif
+
 int version(int flags)
 {
 	JsonNode *json = json_mkobject();
@@ -654,33 +1754,42 @@ int version(int flags)
 int main(int argc, char **argv)
 {
 	int c, key_delim = 0;
-	bool showversion = false;
-	char *kv, *js_string, *progname, *buf, *p;
+	bool showversion = false, coprocess = false;
+	char *sock_path = NULL;
+	char *kv, *progname, *buf, *p;
 	char *in_file = NULL, *in_str;
+	char **merge = NULL, **words = NULL;
+	char *words_file = NULL;
+	int nmerge = 0, nstdin = 0;
+	JsonTape *in_tape = NULL;
 	char *out_file = NULL;
 	FILE *out = stdout;
 	size_t in_len = 0;
 	int ttyin = isatty(fileno(stdin));
 	int ttyout = isatty(fileno(stdout));
-	int flags = 0;
-	JsonNode *json, *op;
-
-#if HAVE_PLEDGE
-	if (pledge("stdio rpath", NULL) == -1) {
-		err(1, "pledge");
-	}
-#endif
+	int flags = 0, jobs = 1;
+	JsonNode *json;
+	JsonArena *arena;
 
 	progname = (progname = strrchr(*argv, '/')) ? progname + 1 : *argv;
 
-	while ((c = getopt(argc, argv, "aBDd:f:hpeno:vV")) != EOF) {
+	while ((c = getopt(argc, argv, "0aA:BcDd:f:hi:j:m:penro:u:vV")) != EOF) {
 		switch (c) {
+			case '0':
+				words_file = "-";
+				break;
 			case 'a':
 				flags |= FLAG_ARRAY;
 				break;
+			case 'A':
+				words_file = optarg;
+				break;
 			case 'B':
 				flags |= FLAG_NOBOOL;
 				break;
+			case 'c':
+				coprocess = true;
+				break;
 			case 'D':
 				json_dedup_members(true);
 				break;
@@ -693,6 +1802,22 @@ int main(int argc, char **argv)
 			case 'h':
 				usage(progname);
 				return (0);
+			case 'i':
+				spacer = indentation(optarg);
+				flags |= FLAG_PRETTY;
+				break;
+			case 'j':
+				jobs = strtol(optarg, &p, 10);
+				if (*optarg == 0 || *p != 0 || jobs < 1) {
+					errx(1, "Invalid number of jobs %s", optarg);
+				}
+				break;
+			case 'm':
+				if (merge == NULL && (merge = calloc(argc, sizeof(char *))) == NULL) {
+					errx(1, "Cannot allocate memory");
+				}
+				merge[nmerge++] = optarg;
+				break;
 			case 'p':
 				flags |= FLAG_PRETTY;
 				break;
@@ -702,9 +1827,18 @@ int main(int argc, char **argv)
 			case 'n':
 				flags |= FLAG_SKIPNULLS;
 				break;
+			case 'r':
+				flags |= FLAG_RECORDS;
+				break;
 			case 'o':
 				out_file = optarg;
 				break;
+			case 'u':
+#ifdef _WIN32
+				errx(1, "Unix-domain sockets are not supported on this platform");
+#endif
+				sock_path = optarg;
+				break;
 			case 'v':
 				printf("jo %s\n", PACKAGE_VERSION);
 				exit(0);
@@ -716,6 +1850,13 @@ int main(int argc, char **argv)
 		}
 	}
 
+#if HAVE_PLEDGE
+	if (pledge(sock_path ? "stdio rpath unix proc" :
+	    (flags & FLAG_RECORDS) && jobs > 1 ? "stdio rpath proc" : "stdio rpath", NULL) == -1) {
+		err(1, "pledge");
+	}
+#endif
+
 	if (showversion) {
 		return(version(flags));
 	}
@@ -723,108 +1864,111 @@ int main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
-	pile = json_mkobject();
+	/*
+	 * Every node of the document comes from one arena so that
+	 * the whole tree is released in one go when we're done.
+	 */
+	arena = json_arena_new();
+	json_arena_use(arena);
+
+	if ((flags & FLAG_RECORDS) || coprocess || sock_path) {
+		if (argc > 0 || words_file != NULL) {
+			errx(1, "Words are read from stdin in record and request modes");
+		}
+	}
+
+	for (c = 0; c < nmerge; c++) {
+		nstdin += strcmp(merge[c], "-") == 0;
+	}
+	if (in_file != NULL) {
+		nstdin += strcmp(in_file, "-") == 0;
+	}
+	if (words_file != NULL) {
+		nstdin += strcmp(words_file, "-") == 0;
+	}
+	if (nstdin > 1) {
+		errx(1, "Only one of -f, -m and -A can read stdin");
+	}
+	if (nstdin > 0 && ((flags & FLAG_RECORDS) || coprocess)) {
+		errx(1, "Cannot read both -f or -m and words from stdin");
+	}
+
 	if (in_file != NULL) {
 		if ((in_str = slurp_file(in_file, &in_len, false)) == NULL) {
 			errx(1, "Error reading file %s", in_file);
 		}
-		json = json_decode(in_str);
-		if (json) {
-			switch (json->tag) {
-				case JSON_ARRAY:
-					flags |= FLAG_ARRAY;
-					break;
-				case JSON_OBJECT:
-					break;
-				default:
-					errx(1, "Input JSON not an array or object: %s", stringify(json, flags));
-			}
-		} else
-			json = (flags & FLAG_ARRAY) ? json_mkarray() : json_mkobject();
-	} else {
-		json = (flags & FLAG_ARRAY) ? json_mkarray() : json_mkobject();
+		/* Every document starts from the same tape; the text isn't needed */
+		in_tape = json_tape_decode(in_str);
+		slurp_release();
+	}
+	if (nmerge > 0) {
+		in_tape = merge_files(in_tape, merge, nmerge, arena);
+		free(merge);
 	}
 
-	if (argc == 0) {
+#ifndef _WIN32
+	if (sock_path != NULL) {
+		serve_socket(sock_path, flags, key_delim, in_tape, arena);
+	}
+#endif
+	if (coprocess) {
+		serve(fileno(stdin), stdout, flags, key_delim, in_tape, arena);
+		json_arena_free(arena);
+		json_tape_free(in_tape);
+		return (0);
+	}
+
+	if (flags & FLAG_RECORDS) {
+		if (out_file != NULL) {
+			out = open_output(out_file, &ttyout);
+		}
+		records(fileno(stdin), jobs, flags, key_delim, in_tape, arena, out, ttyin, ttyout);
+		if (fflush(out) == EOF) {
+			err(1, "Cannot write output");
+		}
+		json_arena_free(arena);
+		json_tape_free(in_tape);
+		return (0);
+	}
+
+	json = new_document(in_tape, &flags);
+
+	if (words_file != NULL) {
+		argv = words = read_words(words_file, argv, &argc);
+	}
+	if (argc == 0 && words_file == NULL) {
 		if (flags & FLAG_NOSTDIN) {
 			return(0);
 		}
-		while ((buf = slurp_line(stdin, &in_len)) != NULL && in_len > 0) {
-			p = ttyin ? utf8_from_locale(buf, -1) : buf;
+		LineReader reader;
+		int eol;
+
+		reader_init(&reader, fileno(stdin));
+		while ((buf = reader_next(&reader, &in_len, &eol)) != NULL && in_len > 0) {
+			p = ttyin ? utf8_from_locale(buf, in_len) : buf;
 			append_kv(json, flags, key_delim, p);
 			if (ttyin) utf8_free(p);
-			if (buf) free(buf);
 		}
+		reader_free(&reader);
 	} else {
-		while ((kv = *argv++)) {
-			if (kv[0] == '-' && !(flags & COERCE_MASK)) {
-				/* Set one-shot coerce flag */
-				switch (kv[1]) {
-					case 'b':
-						flags |= TAG_FLAG_BOOL;
-						break;
-					case 's':
-						flags |= TAG_FLAG_STRING;
-						break;
-					case 'n':
-						flags |= TAG_FLAG_NUMBER;
-						break;
-					default:
-						/* Treat as normal input */
-						p = utf8_from_locale(kv, -1);
-						append_kv(json, flags, key_delim, p);
-						utf8_free(p);
-						/* Reset any one-shot coerce flags */
-						flags &= ~(COERCE_MASK);
-				}
-			} else {
-				p = utf8_from_locale(kv, -1);
-				append_kv(json, flags, key_delim, p);
-				utf8_free(p);
-				/* Reset any one-shot coerce flags */
-				flags &= ~(COERCE_MASK);
-			}
+		if (jobs > 1) {
+			prefetch(argv, argc, flags, jobs);
 		}
-	}
-
-	/*
-	 * See if we have any nested objects or arrays in the pile,
-	 * and copy these into our main object if so.
-	 */
-
-	json_foreach(op, pile) {
-		JsonNode *o;
-
-		if (op->tag == JSON_ARRAY) {
-			o = json_mkarray();
-		} else if (op->tag == JSON_OBJECT) {
-			o = json_mkobject();
-		} else {
-			continue;
+		while ((kv = *argv++)) {
+			add_word(json, &flags, key_delim, kv);
 		}
-		json_copy_to_object(o, op, 0);
-		json_append_member(json, op->key, o);
-	}
-
-
-	if ((js_string = stringify(json, flags)) == NULL) {
-		fprintf(stderr, "Invalid JSON\n");
-		exit(2);
+		prefetch_free();
+		free(words);
 	}
 
 	if (out_file != NULL) {
-		out = fopen(out_file, "w");
-		if (out == NULL) {
-			perror(out_file);
-			errx(1, "Cannot open %s for writing", out_file);
-		}
-		ttyout = isatty(fileno(out));
+		out = open_output(out_file, &ttyout);
 	}
-	p = ttyout ? locale_from_utf8(js_string, -1) : js_string;
-	fprintf(out, "%s\n", p);
-	if (ttyout) locale_free(p);
-	free(js_string);
-	json_delete(json);
-	json_delete(pile);
+	print_json(out, json, flags, ttyout);
+	if (fflush(out) == EOF) {
+		err(1, "Cannot write output");
+	}
+	json_arena_free(arena);
+	json_tape_free(in_tape);
 	return (0);
 }
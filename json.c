@@ -24,6 +24,8 @@
 #include "json.h"
 
 #include <assert.h>
+#include <limits.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -61,15 +63,25 @@ static char *json_strdup(const char *str)
 	return ret;
 }
 
-/* String buffer */
+/*
+ * String buffer
+ *
+ * An SB with a stream attached (see sb_init_stream) never grows: when it
+ * fills up, its contents are written to the stream and it starts over.
+ */
 
 typedef struct
 {
 	char *cur;
 	char *end;
 	char *start;
+	FILE *fp;
+	bool failed; /* a write to fp failed */
 } SB;
 
+/* Size of the buffer used when writing straight to a stream */
+#define SB_STREAM_SIZE	(64 * 1024)
+
 static void sb_init(SB *sb)
 {
 	sb->start = (char*) malloc(17);
@@ -77,19 +89,51 @@ static void sb_init(SB *sb)
 		out_of_memory();
 	sb->cur = sb->start;
 	sb->end = sb->start + 16;
+	sb->fp = NULL;
+	sb->failed = false;
+}
+
+static void sb_init_stream(SB *sb, FILE *fp)
+{
+	sb->start = (char*) malloc(SB_STREAM_SIZE + 1);
+	if (sb->start == NULL)
+		out_of_memory();
+	sb->cur = sb->start;
+	sb->end = sb->start + SB_STREAM_SIZE;
+	sb->fp = fp;
+	sb->failed = false;
+}
+
+static void sb_write(SB *sb, const char *bytes, size_t count)
+{
+	if (count > 0 && fwrite(bytes, 1, count, sb->fp) != count)
+		sb->failed = true;
+}
+
+static void sb_flush(SB *sb)
+{
+	sb_write(sb, sb->start, sb->cur - sb->start);
+	sb->cur = sb->start;
 }
 
 /* sb and need may be evaluated multiple times. */
 #define sb_need(sb, need) do {                  \
-		if ((sb)->end - (sb)->cur < (need))     \
+		if ((size_t)((sb)->end - (sb)->cur) < (size_t)(need)) \
 			sb_grow(sb, need);                  \
 	} while (0)
 
-static void sb_grow(SB *sb, int need)
+static void sb_grow(SB *sb, size_t need)
 {
-	size_t length = sb->cur - sb->start;
-	size_t alloc = sb->end - sb->start;
+	size_t length, alloc;
+	
+	if (sb->fp != NULL) {
+		sb_flush(sb);
+		if ((size_t)(sb->end - sb->cur) >= need)
+			return;
+	}
 	
+	length = sb->cur - sb->start;
+	alloc = sb->end - sb->start;
 	do {
 		alloc *= 2;
 	} while (alloc < length + need);
@@ -101,8 +145,16 @@ static void sb_grow(SB *sb, int need)
 	sb->end = sb->start + alloc;
 }
 
-static void sb_put(SB *sb, const char *bytes, int count)
+static void sb_put(SB *sb, const char *bytes, size_t count)
 {
+	if (sb->fp != NULL && (size_t)(sb->end - sb->cur) < count) {
+		sb_flush(sb);
+		if ((size_t)(sb->end - sb->cur) < count) {
+			/* Too big to be worth buffering */
+			sb_write(sb, bytes, count);
+			return;
+		}
+	}
 	sb_need(sb, count);
 	memcpy(sb->cur, bytes, count);
 	sb->cur += count;
@@ -132,392 +184,2734 @@ static void sb_free(SB *sb)
 }
 
 /*
- * Unicode helper functions
+ * Indentation
  *
- * These are taken from the ccan/charset module and customized a bit.
- * Putting them here means the compiler can (choose to) inline them,
- * and it keeps ccan/json from having a dependency.
+ * Each line of pretty output starts with a newline and one copy of the
+ * space string per level of nesting.  An Indent keeps that prefix made
+ * up for the deepest line so far, so that starting a line is a single
+ * sb_put however deep it is.  Compact output has no space string.
  */
 
-/*
- * Type for Unicode codepoints.
- * We need our own because wchar_t might be 16 bits.
- */
-typedef uint32_t js_uchar_t;
+typedef struct
+{
+	const char *space;  /* NULL for compact output */
+	size_t width;       /* strlen(space) */
+	char *prefix;       /* "\n" and then `levels' copies of space */
+	int levels;
+	char small[64];
+} Indent;
 
-/*
- * Validate a single UTF-8 character starting at @s.
- * The string must be null-terminated.
- *
- * If it's valid, return its length (1 thru 4).
- * If it's invalid or clipped, return 0.
- *
- * This function implements the syntax given in RFC3629, which is
- * the same as that given in The Unicode Standard, Version 6.0.
- *
- * It has the following properties:
- *
- *  * All codepoints U+0000..U+10FFFF may be encoded,
- *    except for U+D800..U+DFFF, which are reserved
- *    for UTF-16 surrogate pair encoding.
- *  * UTF-8 byte sequences longer than 4 bytes are not permitted,
- *    as they exceed the range of Unicode.
- *  * The sixty-six Unicode "non-characters" are permitted
- *    (namely, U+FDD0..U+FDEF, U+xxFFFE, and U+xxFFFF).
- */
-static int utf8_validate_cz(const char *s)
+static void indent_init(Indent *in, const char *space)
 {
-	unsigned char c = *s++;
-	
-	if (c <= 0x7F) {        /* 00..7F */
-		return 1;
-	} else if (c <= 0xC1) { /* 80..C1 */
-		/* Disallow overlong 2-byte sequence. */
-		return 0;
-	} else if (c <= 0xDF) { /* C2..DF */
-		/* Make sure subsequent byte is in the range 0x80..0xBF. */
-		if (((unsigned char)*s++ & 0xC0) != 0x80)
-			return 0;
-		
-		return 2;
-	} else if (c <= 0xEF) { /* E0..EF */
-		/* Disallow overlong 3-byte sequence. */
-		if (c == 0xE0 && (unsigned char)*s < 0xA0)
-			return 0;
-		
-		/* Disallow U+D800..U+DFFF. */
-		if (c == 0xED && (unsigned char)*s > 0x9F)
-			return 0;
-		
-		/* Make sure subsequent bytes are in the range 0x80..0xBF. */
-		if (((unsigned char)*s++ & 0xC0) != 0x80)
-			return 0;
-		if (((unsigned char)*s++ & 0xC0) != 0x80)
-			return 0;
-		
-		return 3;
-	} else if (c <= 0xF4) { /* F0..F4 */
-		/* Disallow overlong 4-byte sequence. */
-		if (c == 0xF0 && (unsigned char)*s < 0x90)
-			return 0;
-		
-		/* Disallow codepoints beyond U+10FFFF. */
-		if (c == 0xF4 && (unsigned char)*s > 0x8F)
-			return 0;
-		
-		/* Make sure subsequent bytes are in the range 0x80..0xBF. */
-		if (((unsigned char)*s++ & 0xC0) != 0x80)
-			return 0;
-		if (((unsigned char)*s++ & 0xC0) != 0x80)
-			return 0;
-		if (((unsigned char)*s++ & 0xC0) != 0x80)
-			return 0;
-		
-		return 4;
-	} else {                /* F5..FF */
-		return 0;
-	}
+	in->space = space;
+	in->width = space != NULL ? strlen(space) : 0;
+	in->prefix = in->small;
+	in->prefix[0] = '\n';
+	/* An empty space string makes every prefix just the newline */
+	in->levels = space != NULL && in->width == 0 ? INT_MAX : 0;
 }
 
-/* Validate a null-terminated UTF-8 string. */
-static bool utf8_validate(const char *s)
+static void indent_grow(Indent *in, int depth)
 {
-	int len;
+	size_t fits = (sizeof(in->small) - 1) / in->width;
+	char *prefix = in->small;
+	int levels = (int) fits, i;
 	
-	for (; *s != 0; s += len) {
-		len = utf8_validate_cz(s);
-		if (len == 0)
-			return false;
+	if ((size_t) depth > fits) {
+		levels = depth > 2 * in->levels ? depth : 2 * in->levels;
+		prefix = (char*) malloc(1 + (size_t) levels * in->width);
+		if (prefix == NULL)
+			out_of_memory();
+		prefix[0] = '\n';
 	}
+	for (i = 0; i < levels; i++)
+		memcpy(prefix + 1 + (size_t) i * in->width, in->space, in->width);
 	
-	return true;
+	if (in->prefix != in->small)
+		free(in->prefix);
+	in->prefix = prefix;
+	in->levels = levels;
 }
 
-/*
- * Read a single UTF-8 character starting at @s,
- * returning the length, in bytes, of the character read.
- *
- * This function assumes input is valid UTF-8,
- * and that there are enough characters in front of @s.
- */
-static int utf8_read_char(const char *s, js_uchar_t *out)
+static void indent_free(Indent *in)
 {
-	const unsigned char *c = (const unsigned char*) s;
-	
-	assert(utf8_validate_cz(s));
+	if (in->prefix != in->small)
+		free(in->prefix);
+}
 
-	if (c[0] <= 0x7F) {
-		/* 00..7F */
-		*out = c[0];
-		return 1;
-	} else if (c[0] <= 0xDF) {
-		/* C2..DF (unless input is invalid) */
-		*out = ((js_uchar_t)c[0] & 0x1F) << 6 |
-		       ((js_uchar_t)c[1] & 0x3F);
-		return 2;
-	} else if (c[0] <= 0xEF) {
-		/* E0..EF */
-		*out = ((js_uchar_t)c[0] &  0xF) << 12 |
-		       ((js_uchar_t)c[1] & 0x3F) << 6  |
-		       ((js_uchar_t)c[2] & 0x3F);
-		return 3;
-	} else {
-		/* F0..F4 (unless input is invalid) */
-		*out = ((js_uchar_t)c[0] &  0x7) << 18 |
-		       ((js_uchar_t)c[1] & 0x3F) << 12 |
-		       ((js_uchar_t)c[2] & 0x3F) << 6  |
-		       ((js_uchar_t)c[3] & 0x3F);
-		return 4;
-	}
+/* Start a new line, indented @depth levels. */
+static void emit_newline(SB *out, Indent *in, int depth)
+{
+	if (depth > in->levels)
+		indent_grow(in, depth);
+	sb_put(out, in->prefix, 1 + (size_t) depth * in->width);
 }
 
 /*
- * Write a single UTF-8 character to @s,
- * returning the length, in bytes, of the character written.
- *
- * @unicode must be U+0000..U+10FFFF, but not U+D800..U+DFFF.
+ * Arena allocator
  *
- * This function will write up to 4 bytes to @out.
+ * Blocks are chained newest first.  The block allocated by json_arena_new
+ * is kept across resets so that a loop building one document per iteration
+ * settles on a single malloc'd block.
  */
-static int utf8_write_char(js_uchar_t unicode, char *out)
+
+#define ARENA_BLOCK_SIZE	(64 * 1024)
+#define ARENA_ALIGN		8
+
+typedef struct ArenaBlock ArenaBlock;
+
+struct ArenaBlock
 {
-	unsigned char *o = (unsigned char*) out;
-	
-	failx(
-		unicode <= 0x10FFFF && !(unicode >= 0xD800 && unicode <= 0xDFFF),
-		1,
-		"Illegal Unicode codepoint 0x%08X found",
-		unicode
-	);
+	ArenaBlock *next;
+	size_t size;
+};
 
-	if (unicode <= 0x7F) {
-		/* U+0000..U+007F */
-		*o++ = unicode;
-		return 1;
-	} else if (unicode <= 0x7FF) {
-		/* U+0080..U+07FF */
-		*o++ = 0xC0 | unicode >> 6;
-		*o++ = 0x80 | (unicode & 0x3F);
-		return 2;
-	} else if (unicode <= 0xFFFF) {
-		/* U+0800..U+FFFF */
-		*o++ = 0xE0 | unicode >> 12;
-		*o++ = 0x80 | (unicode >> 6 & 0x3F);
-		*o++ = 0x80 | (unicode & 0x3F);
-		return 3;
-	} else {
-		/* U+10000..U+10FFFF */
-		*o++ = 0xF0 | unicode >> 18;
-		*o++ = 0x80 | (unicode >> 12 & 0x3F);
-		*o++ = 0x80 | (unicode >> 6 & 0x3F);
-		*o++ = 0x80 | (unicode & 0x3F);
-		return 4;
-	}
+struct JsonArena
+{
+	ArenaBlock *blocks;
+	ArenaBlock *first;
+	char *cur;
+	char *end;
+};
+
+static JsonArena *current_arena;
+
+static ArenaBlock *arena_block_new(size_t size)
+{
+	ArenaBlock *block = (ArenaBlock*) malloc(sizeof(ArenaBlock) + size);
+	if (block == NULL)
+		out_of_memory();
+	block->next = NULL;
+	block->size = size;
+	return block;
 }
 
-/*
- * Compute the Unicode codepoint of a UTF-16 surrogate pair.
- *
- * @uc should be 0xD800..0xDBFF, and @lc should be 0xDC00..0xDFFF.
- * If they aren't, this function returns false.
- */
-static bool from_surrogate_pair(uint16_t uc, uint16_t lc, js_uchar_t *unicode)
+#define arena_block_data(block) ((char*) ((block) + 1))
+
+static void *arena_alloc(JsonArena *arena, size_t size)
 {
-	if (uc >= 0xD800 && uc <= 0xDBFF && lc >= 0xDC00 && lc <= 0xDFFF) {
-		*unicode = 0x10000 + ((((js_uchar_t)uc & 0x3FF) << 10) | (lc & 0x3FF));
-		return true;
-	} else {
-		return false;
+	ArenaBlock *block;
+	char *ret;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	if ((size_t)(arena->end - arena->cur) < size) {
+		if (size > ARENA_BLOCK_SIZE / 4) {
+			/* Give big requests a block of their own, behind the current one. */
+			block = arena_block_new(size);
+			block->next = arena->blocks->next;
+			arena->blocks->next = block;
+			return arena_block_data(block);
+		}
+		block = arena_block_new(ARENA_BLOCK_SIZE);
+		block->next = arena->blocks;
+		arena->blocks = block;
+		arena->cur = arena_block_data(block);
+		arena->end = arena->cur + block->size;
 	}
+
+	ret = arena->cur;
+	arena->cur += size;
+	return ret;
 }
 
-/*
- * Construct a UTF-16 surrogate pair given a Unicode codepoint.
- *
- * @unicode must be U+10000..U+10FFFF.
- */
-static void to_surrogate_pair(js_uchar_t unicode, uint16_t *uc, uint16_t *lc)
+static char *arena_strdup(JsonArena *arena, const char *str, size_t n)
 {
-	js_uchar_t n;
-	
-	failx(
-		unicode >= 0x10000 && unicode <= 0x10FFFF,
-		1,
-		"Cannot construct UTF-16 surrogate pair for Unicode codepoint 0x%08X",
-		unicode
-	);
-	
-	n = unicode - 0x10000;
-	*uc = ((n >> 10) & 0x3FF) | 0xD800;
-	*lc = (n & 0x3FF) | 0xDC00;
+	char *ret = (char*) arena_alloc(arena, n + 1);
+	memcpy(ret, str, n);
+	ret[n] = 0;
+	return ret;
 }
 
-#define is_space(c) ((c) == '\t' || (c) == '\n' || (c) == '\r' || (c) == ' ')
-#define is_digit(c) ((c) >= '0' && (c) <= '9')
+JsonArena *json_arena_new(void)
+{
+	JsonArena *arena = (JsonArena*) malloc(sizeof(JsonArena));
+	if (arena == NULL)
+		out_of_memory();
+	arena->blocks = arena->first = arena_block_new(ARENA_BLOCK_SIZE);
+	arena->cur = arena_block_data(arena->blocks);
+	arena->end = arena->cur + arena->blocks->size;
+	return arena;
+}
 
-static bool parse_value     (const char **sp, JsonNode        **out);
-static bool parse_string    (const char **sp, char            **out);
-static bool parse_number    (const char **sp, double           *out);
-static bool parse_array     (const char **sp, JsonNode        **out);
-static bool parse_object    (const char **sp, JsonNode        **out);
-static bool parse_hex16     (const char **sp, uint16_t         *out);
+JsonArena *json_arena_use(JsonArena *arena)
+{
+	JsonArena *prev = current_arena;
+	current_arena = arena;
+	return prev;
+}
 
-static bool expect_literal  (const char **sp, const char *str);
-static void skip_space      (const char **sp);
+void json_arena_reset(JsonArena *arena)
+{
+	ArenaBlock *block, *next;
 
-static void emit_value              (SB *out, const JsonNode *node);
-static void emit_value_indented     (SB *out, const JsonNode *node, const char *space, int indent_level);
-static void emit_string             (SB *out, const char *str);
-static void emit_number             (SB *out, double num);
-static void emit_array              (SB *out, const JsonNode *array);
-static void emit_array_indented     (SB *out, const JsonNode *array, const char *space, int indent_level);
-static void emit_object             (SB *out, const JsonNode *object);
-static void emit_object_indented    (SB *out, const JsonNode *object, const char *space, int indent_level);
+	for (block = arena->blocks; block != NULL; block = next) {
+		next = block->next;
+		if (block != arena->first)
+			free(block);
+	}
+	block = arena->blocks = arena->first;
+	block->next = NULL;
+	arena->cur = arena_block_data(block);
+	arena->end = arena->cur + block->size;
+}
 
-static int write_hex16(char *out, uint16_t val);
+void json_arena_free(JsonArena *arena)
+{
+	ArenaBlock *block, *next;
 
-static JsonNode *mknode(JsonTag tag);
-static void append_node(JsonNode *parent, JsonNode *child);
-static void prepend_node(JsonNode *parent, JsonNode *child);
-static void insert_node(JsonNode *parent, JsonNode *child);
-static void append_member(JsonNode *object, char *key, JsonNode *value);
+	if (arena == NULL)
+		return;
+	if (current_arena == arena)
+		current_arena = NULL;
+	for (block = arena->blocks; block != NULL; block = next) {
+		next = block->next;
+		free(block);
+	}
+	free(arena);
+}
 
-static void (*append_member_node_fn)(JsonNode *parent, JsonNode *child) = append_node;
+static size_t utf8_valid_prefix(const char *s, size_t n);
+
+/* Copy @n bytes of ASCII text for storage in @node. */
+static char *node_strndup(const JsonNode *node, const char *str, size_t n)
+{
+	char *ret;
+	
+	if (node->arena != NULL)
+		return arena_strdup(node->arena, str, n);
+	ret = (char*) malloc(n + 1);
+	if (ret == NULL)
+		out_of_memory();
+	memcpy(ret, str, n);
+	ret[n] = 0;
+	return ret;
+}
+
+/*
+ * Copy a key or string for storage in @node, using the node's allocator.
+ *
+ * This is where text enters a tree, so it is validated here, once: each
+ * byte that isn't part of a valid UTF-8 character is replaced by U+FFFD,
+ * which is what emit_string would otherwise have to write for it.
+ */
+static char *node_strdup(const JsonNode *node, const char *str)
+{
+	size_t n = strlen(str), valid = utf8_valid_prefix(str, n);
+	SB sb;
+	char *ret;
+	
+	if (valid == n) {
+		if (node->arena != NULL)
+			return arena_strdup(node->arena, str, n);
+		return json_strdup(str);
+	}
+	
+	sb_init(&sb);
+	for (;;) {
+		sb_put(&sb, str, valid);
+		str += valid;
+		n -= valid;
+		if (n == 0)
+			break;
+		sb_put(&sb, "\xEF\xBF\xBD", 3);
+		str++;
+		n--;
+		valid = utf8_valid_prefix(str, n);
+	}
+	ret = sb_finish(&sb);
+	if (node->arena != NULL) {
+		ret = arena_strdup(node->arena, ret, sb.cur - sb.start);
+		sb_free(&sb);
+	}
+	return ret;
+}
+
+/*
+ * Byte scanners
+ *
+ * These return the length of the run of bytes of some kind at the start
+ * of s[0..n), looking at 16 or 32 bytes at a time where the CPU allows.
+ *
+ * ascii_run:  bytes below 0x80.
+ * plain_run:  bytes emit_string copies as they are: 0x20..@last except
+ *             '"' and '\\'.  @last is 0x7F, or 0xFF for strings known
+ *             to be valid UTF-8.
+ * utf8_run:   valid UTF-8, ending at a character boundary; it may stop
+ *             short of the first error (see utf8_valid_prefix).
+ *
+ * classify sorts the 64 bytes at s into the classes of a BlockClass,
+ * for the structural index (see json_validate).
+ */
+
+/* Bit i of each mask stands for byte i of a 64-byte block */
+typedef struct {
+	uint64_t quote;         /* '"' */
+	uint64_t backslash;     /* '\\' */
+	uint64_t op;            /* { } [ ] : , */
+	uint64_t space;         /* JSON whitespace */
+	uint64_t control;       /* below 0x20, including \t \n \r */
+	uint64_t high;          /* 0x80 and up */
+} BlockClass;
+
+typedef size_t (*AsciiRun)(const char *s, size_t n);
+typedef size_t (*PlainRun)(const char *s, size_t n, unsigned char last);
+typedef size_t (*Utf8Run)(const char *s, size_t n);
+typedef void (*Classify)(const char *s, BlockClass *bc);
+
+static size_t ascii_run_scalar(const char *s, size_t n)
+{
+	size_t i;
+	
+	for (i = 0; i < n; i++) {
+		if ((unsigned char)s[i] >= 0x80)
+			break;
+	}
+	return i;
+}
+
+static size_t plain_run_scalar(const char *s, size_t n, unsigned char last)
+{
+	size_t i;
+	
+	for (i = 0; i < n; i++) {
+		unsigned char c = s[i];
+		if (c < 0x20 || c > last || c == '"' || c == '\\')
+			break;
+	}
+	return i;
+}
+
+static void classify_scalar(const char *s, BlockClass *bc)
+{
+	int i;
+	
+	memset(bc, 0, sizeof(BlockClass));
+	for (i = 0; i < 64; i++) {
+		unsigned char c = s[i];
+		uint64_t bit = (uint64_t) 1 << i;
+		
+		switch (c) {
+			case '"':
+				bc->quote |= bit;
+				break;
+			case '\\':
+				bc->backslash |= bit;
+				break;
+			case '{':
+			case '}':
+			case '[':
+			case ']':
+			case ':':
+			case ',':
+				bc->op |= bit;
+				break;
+			case '\t':
+			case '\n':
+			case '\r':
+				bc->control |= bit;
+				/* fall through */
+			case ' ':
+				bc->space |= bit;
+				break;
+			default:
+				if (c < 0x20)
+					bc->control |= bit;
+				else if (c >= 0x80)
+					bc->high |= bit;
+		}
+	}
+}
+
+/* Leave it all to utf8_valid_prefix. */
+static size_t utf8_run_scalar(const char *s, size_t n)
+{
+	(void) s;
+	(void) n;
+	return 0;
+}
+
+/*
+ * Back up from @i, where a UTF-8 scanner stopped, to the start of the
+ * last character before it, which may be cut short or run on past @i.
+ * Everything before that character was found valid.
+ */
+static size_t utf8_char_start(const char *s, size_t i)
+{
+	size_t j = i;
+	
+	while (j > 0 && i - j < 3 && ((unsigned char)s[j - 1] & 0xC0) == 0x80)
+		j--;
+	if (j > 0 && (unsigned char)s[j - 1] >= 0xC0)
+		j--;
+	return j;
+}
+
+#if (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))) || \
+    (defined(__aarch64__) && defined(__ARM_NEON))
+/*
+ * Tables for validating UTF-8 a block at a time, after Keiser and Lemire,
+ * "Validating UTF-8 In Less Than One Instruction Per Byte" (2021), as in
+ * simdjson.  Each byte is paired with the one before it, and the high and
+ * low nibbles of the first and the high nibble of the second are looked
+ * up; an entry has a bit set for each error the pair may be part of, so a
+ * bit set in all three lookups is an error.  A continuation byte that is
+ * the third or fourth of its character pairs with a continuation too,
+ * which UTF8_TWO_CONTS flags; for those it is flipped, so that it flags
+ * the ones that aren't continuations instead.
+ */
+
+#define UTF8_TOO_SHORT		0x01	/* lead, then no continuation */
+#define UTF8_TOO_LONG		0x02	/* ASCII, then a continuation */
+#define UTF8_OVERLONG_3		0x04	/* E0 80..9F */
+#define UTF8_TOO_LARGE		0x08	/* F4 90..BF, F5..FF 80..BF */
+#define UTF8_SURROGATE		0x10	/* ED A0..BF */
+#define UTF8_OVERLONG_2		0x20	/* C0..C1 80..BF */
+#define UTF8_TOO_LARGE_1000	0x40	/* F5..FF 80..8F */
+#define UTF8_OVERLONG_4		0x40	/* F0 80..8F */
+#define UTF8_TWO_CONTS		0x80	/* continuation, then another */
+#define UTF8_CARRY		(UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+/* By the high nibble of the first byte */
+static const unsigned char utf8_byte_1_high[16] = {
+	UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+	UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+	UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+	UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+	UTF8_TOO_SHORT,
+	UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+	UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+};
+
+/* By the low nibble of the first byte */
+static const unsigned char utf8_byte_1_low[16] = {
+	UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+	UTF8_CARRY | UTF8_OVERLONG_2,
+	UTF8_CARRY,
+	UTF8_CARRY,
+	UTF8_CARRY | UTF8_TOO_LARGE,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+};
+
+/* By the high nibble of the second byte */
+static const unsigned char utf8_byte_2_high[16] = {
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+};
+
+/*
+ * A byte above its entry here starts a character that doesn't end in the
+ * block: the last 16 entries are for 16-byte blocks.
+ */
+static const unsigned char utf8_incomplete_max[32] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xEF, 0xDF, 0xBF
+};
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+#define HAVE_X86_SCANNERS 1
+
+__attribute__((target("sse2")))
+static size_t ascii_run_sse2(const char *s, size_t n)
+{
+	size_t i;
+	
+	for (i = 0; i + 16 <= n; i += 16) {
+		unsigned int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) (s + i)));
+		
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return i + ascii_run_scalar(s + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static size_t plain_run_sse2(const char *s, size_t n, unsigned char last)
+{
+	const __m128i space = _mm_set1_epi8(0x20);
+	const __m128i top = _mm_set1_epi8((char) last);
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	size_t i;
+	
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+		__m128i in_range = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, space), v),
+			_mm_cmpeq_epi8(_mm_min_epu8(v, top), v));
+		__m128i special = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash));
+		unsigned int mask = _mm_movemask_epi8(_mm_andnot_si128(special, in_range)) ^ 0xFFFF;
+		
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return i + plain_run_scalar(s + i, n - i, last);
+}
+
+/* '[' and ']' are '{' and '}' without bit 0x20, so OR-ing it in folds them. */
+__attribute__((target("sse2")))
+static void classify_sse2(const char *s, BlockClass *bc)
+{
+	const __m128i bit5 = _mm_set1_epi8(0x20);
+	const __m128i below_space = _mm_set1_epi8(0x1F);
+	uint64_t quote = 0, backslash = 0, op = 0, space = 0, control = 0, high = 0;
+	int i;
+	
+	for (i = 0; i < 64; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+		__m128i folded = _mm_or_si128(v, bit5);
+		__m128i is_op = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('{')), _mm_cmpeq_epi8(folded, _mm_set1_epi8('}'))),
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')), _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+		__m128i is_space = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, bit5), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+		
+		quote |= (uint64_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << i;
+		backslash |= (uint64_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << i;
+		op |= (uint64_t) _mm_movemask_epi8(is_op) << i;
+		space |= (uint64_t) _mm_movemask_epi8(is_space) << i;
+		control |= (uint64_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, below_space), v)) << i;
+		high |= (uint64_t) _mm_movemask_epi8(v) << i;
+	}
+	bc->quote = quote;
+	bc->backslash = backslash;
+	bc->op = op;
+	bc->space = space;
+	bc->control = control;
+	bc->high = high;
+}
+
+/* Needs pshufb, so SSSE3 rather than SSE2 */
+__attribute__((target("ssse3")))
+static size_t utf8_run_ssse3(const char *s, size_t n)
+{
+	const __m128i byte_1_high = _mm_loadu_si128((const __m128i*) utf8_byte_1_high);
+	const __m128i byte_1_low = _mm_loadu_si128((const __m128i*) utf8_byte_1_low);
+	const __m128i byte_2_high = _mm_loadu_si128((const __m128i*) utf8_byte_2_high);
+	const __m128i incomplete_max = _mm_loadu_si128((const __m128i*) (utf8_incomplete_max + 16));
+	const __m128i nibble = _mm_set1_epi8(0x0F);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i prev = zero, incomplete = zero;
+	size_t i;
+	
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+		__m128i prev1, special, must23, error;
+		
+		if (_mm_movemask_epi8(v) == 0) {
+			/* ASCII: fine unless the last block left a character open */
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(incomplete, zero)) != 0xFFFF)
+				break;
+			prev = v;
+			continue;
+		}
+		prev1 = _mm_alignr_epi8(v, prev, 15);
+		special = _mm_and_si128(_mm_and_si128(
+			_mm_shuffle_epi8(byte_1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+			_mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, nibble))),
+			_mm_shuffle_epi8(byte_2_high, _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+		must23 = _mm_or_si128(
+			_mm_subs_epu8(_mm_alignr_epi8(v, prev, 14), _mm_set1_epi8(0xE0 - 0x80)),
+			_mm_subs_epu8(_mm_alignr_epi8(v, prev, 13), _mm_set1_epi8(0xF0 - 0x80)));
+		error = _mm_xor_si128(_mm_and_si128(must23, _mm_set1_epi8((char) 0x80)), special);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, zero)) != 0xFFFF)
+			break;
+		incomplete = _mm_subs_epu8(v, incomplete_max);
+		prev = v;
+	}
+	return utf8_char_start(s, i);
+}
+
+/*
+ * The AVX2 versions finish with the scalar loop: calling legacy-SSE
+ * code with the upper halves of the registers dirty is slow.
+ */
+
+__attribute__((target("avx2")))
+static size_t ascii_run_avx2(const char *s, size_t n)
+{
+	size_t i;
+	
+	for (i = 0; i + 32 <= n; i += 32) {
+		unsigned int mask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*) (s + i)));
+		
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return i + ascii_run_scalar(s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t plain_run_avx2(const char *s, size_t n, unsigned char last)
+{
+	const __m256i space = _mm256_set1_epi8(0x20);
+	const __m256i top = _mm256_set1_epi8((char) last);
+	const __m256i quote = _mm256_set1_epi8('"');
+	const __m256i backslash = _mm256_set1_epi8('\\');
+	size_t i;
+	
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*) (s + i));
+		__m256i in_range = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(v, space), v),
+			_mm256_cmpeq_epi8(_mm256_min_epu8(v, top), v));
+		__m256i special = _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash));
+		unsigned int mask = ~(unsigned int) _mm256_movemask_epi8(_mm256_andnot_si256(special, in_range));
+		
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return i + plain_run_scalar(s + i, n - i, last);
+}
+
+/* prev1..prev3 are v moved up 1..3 bytes, with the end of prev below */
+__attribute__((target("avx2")))
+static size_t utf8_run_avx2(const char *s, size_t n)
+{
+	const __m256i byte_1_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) utf8_byte_1_high));
+	const __m256i byte_1_low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) utf8_byte_1_low));
+	const __m256i byte_2_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) utf8_byte_2_high));
+	const __m256i incomplete_max = _mm256_loadu_si256((const __m256i*) utf8_incomplete_max);
+	const __m256i nibble = _mm256_set1_epi8(0x0F);
+	__m256i prev = _mm256_setzero_si256(), incomplete = _mm256_setzero_si256();
+	size_t i;
+	
+	for (i = 0; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*) (s + i));
+		__m256i joined, prev1, special, must23, error;
+		
+		if (_mm256_movemask_epi8(v) == 0) {
+			/* ASCII: fine unless the last block left a character open */
+			if (!_mm256_testz_si256(incomplete, incomplete))
+				break;
+			prev = v;
+			continue;
+		}
+		/* The high half of prev and the low half of v, for alignr */
+		joined = _mm256_permute2x128_si256(prev, v, 0x21);
+		prev1 = _mm256_alignr_epi8(v, joined, 15);
+		special = _mm256_and_si256(_mm256_and_si256(
+			_mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+			_mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble))),
+			_mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+		must23 = _mm256_or_si256(
+			_mm256_subs_epu8(_mm256_alignr_epi8(v, joined, 14), _mm256_set1_epi8(0xE0 - 0x80)),
+			_mm256_subs_epu8(_mm256_alignr_epi8(v, joined, 13), _mm256_set1_epi8(0xF0 - 0x80)));
+		error = _mm256_xor_si256(_mm256_and_si256(must23, _mm256_set1_epi8((char) 0x80)), special);
+		if (!_mm256_testz_si256(error, error))
+			break;
+		incomplete = _mm256_subs_epu8(v, incomplete_max);
+		prev = v;
+	}
+	return utf8_char_start(s, i);
+}
+
+__attribute__((target("avx2")))
+static void classify_avx2(const char *s, BlockClass *bc)
+{
+	/*
+	 * Look up each byte by its low nibble (simdjson's tables): a byte is
+	 * whitespace if it equals its entry in space_table, and an operator
+	 * if it equals its entry in op_table once '[' and ']' are folded.
+	 * Bytes with the top bit set look up 0 and match neither.
+	 */
+	const __m256i space_table = _mm256_setr_epi8(
+		' ', 100, 100, 100, 17, 100, 113, 2, 100, '\t', '\n', 112, 100, '\r', 100, 100,
+		' ', 100, 100, 100, 17, 100, 113, 2, 100, '\t', '\n', 112, 100, '\r', 100, 100);
+	const __m256i op_table = _mm256_setr_epi8(
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, ':', '{', ',', '}', 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, ':', '{', ',', '}', 0, 0);
+	const __m256i bit5 = _mm256_set1_epi8(0x20);
+	const __m256i below_space = _mm256_set1_epi8(0x1F);
+	uint64_t quote = 0, backslash = 0, op = 0, space = 0, control = 0, high = 0;
+	int i;
+	
+	for (i = 0; i < 64; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*) (s + i));
+		__m256i is_op = _mm256_cmpeq_epi8(_mm256_or_si256(v, bit5), _mm256_shuffle_epi8(op_table, v));
+		__m256i is_space = _mm256_cmpeq_epi8(v, _mm256_shuffle_epi8(space_table, v));
+		
+		quote |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))) << i;
+		backslash |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))) << i;
+		op |= (uint64_t) (uint32_t) _mm256_movemask_epi8(is_op) << i;
+		space |= (uint64_t) (uint32_t) _mm256_movemask_epi8(is_space) << i;
+		control |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(v, below_space), v)) << i;
+		high |= (uint64_t) (uint32_t) _mm256_movemask_epi8(v) << i;
+	}
+	bc->quote = quote;
+	bc->backslash = backslash;
+	bc->op = op;
+	bc->space = space;
+	bc->control = control;
+	bc->high = high;
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+
+#define HAVE_NEON_SCANNERS 1
+
+static size_t ascii_run_neon(const char *s, size_t n)
+{
+	size_t i;
+	
+	for (i = 0; i + 16 <= n; i += 16) {
+		if (vmaxvq_u8(vld1q_u8((const uint8_t*) (s + i))) >= 0x80)
+			break;
+	}
+	return i + ascii_run_scalar(s + i, n - i);
+}
+
+static size_t plain_run_neon(const char *s, size_t n, unsigned char last)
+{
+	const uint8x16_t space = vdupq_n_u8(0x20);
+	const uint8x16_t top = vdupq_n_u8(last);
+	const uint8x16_t quote = vdupq_n_u8('"');
+	const uint8x16_t backslash = vdupq_n_u8('\\');
+	size_t i;
+	
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t*) (s + i));
+		uint8x16_t special = vorrq_u8(vorrq_u8(vcltq_u8(v, space), vcgtq_u8(v, top)),
+			vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, backslash)));
+		
+		if (vmaxvq_u8(special) != 0)
+			break;
+	}
+	return i + plain_run_scalar(s + i, n - i, last);
+}
+
+static size_t utf8_run_neon(const char *s, size_t n)
+{
+	const uint8x16_t byte_1_high = vld1q_u8(utf8_byte_1_high);
+	const uint8x16_t byte_1_low = vld1q_u8(utf8_byte_1_low);
+	const uint8x16_t byte_2_high = vld1q_u8(utf8_byte_2_high);
+	const uint8x16_t incomplete_max = vld1q_u8(utf8_incomplete_max + 16);
+	const uint8x16_t nibble = vdupq_n_u8(0x0F);
+	uint8x16_t prev = vdupq_n_u8(0), incomplete = vdupq_n_u8(0);
+	size_t i;
+	
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t*) (s + i));
+		uint8x16_t prev1, special, must23, error;
+		
+		if (vmaxvq_u8(v) < 0x80) {
+			/* ASCII: fine unless the last block left a character open */
+			if (vmaxvq_u8(incomplete) != 0)
+				break;
+			prev = v;
+			continue;
+		}
+		prev1 = vextq_u8(prev, v, 15);
+		special = vandq_u8(vandq_u8(
+			vqtbl1q_u8(byte_1_high, vshrq_n_u8(prev1, 4)),
+			vqtbl1q_u8(byte_1_low, vandq_u8(prev1, nibble))),
+			vqtbl1q_u8(byte_2_high, vshrq_n_u8(v, 4)));
+		must23 = vorrq_u8(
+			vqsubq_u8(vextq_u8(prev, v, 14), vdupq_n_u8(0xE0 - 0x80)),
+			vqsubq_u8(vextq_u8(prev, v, 13), vdupq_n_u8(0xF0 - 0x80)));
+		error = veorq_u8(vandq_u8(must23, vdupq_n_u8(0x80)), special);
+		if (vmaxvq_u8(error) != 0)
+			break;
+		incomplete = vqsubq_u8(v, incomplete_max);
+		prev = v;
+	}
+	return utf8_char_start(s, i);
+}
+
+/* Gather the top bits of four compare results into a 64-bit mask */
+static uint64_t neon_mask64(uint8x16_t a, uint8x16_t b, uint8x16_t c, uint8x16_t d)
+{
+	const uint8x16_t bits = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+	uint8x16_t ab = vpaddq_u8(vandq_u8(a, bits), vandq_u8(b, bits));
+	uint8x16_t cd = vpaddq_u8(vandq_u8(c, bits), vandq_u8(d, bits));
+	uint8x16_t abcd = vpaddq_u8(ab, cd);
+	
+	abcd = vpaddq_u8(abcd, abcd);
+	return vgetq_lane_u64(vreinterpretq_u64_u8(abcd), 0);
+}
+
+static void classify_neon(const char *s, BlockClass *bc)
+{
+	uint8x16_t v[4], quote[4], backslash[4], op[4], space[4], control[4], high[4];
+	int i;
+	
+	for (i = 0; i < 4; i++) {
+		uint8x16_t folded;
+		
+		v[i] = vld1q_u8((const uint8_t*) (s + 16 * i));
+		folded = vorrq_u8(v[i], vdupq_n_u8(0x20));
+		quote[i] = vceqq_u8(v[i], vdupq_n_u8('"'));
+		backslash[i] = vceqq_u8(v[i], vdupq_n_u8('\\'));
+		op[i] = vorrq_u8(vorrq_u8(vceqq_u8(folded, vdupq_n_u8('{')), vceqq_u8(folded, vdupq_n_u8('}'))),
+			vorrq_u8(vceqq_u8(v[i], vdupq_n_u8(':')), vceqq_u8(v[i], vdupq_n_u8(','))));
+		space[i] = vorrq_u8(vorrq_u8(vceqq_u8(v[i], vdupq_n_u8(' ')), vceqq_u8(v[i], vdupq_n_u8('\t'))),
+			vorrq_u8(vceqq_u8(v[i], vdupq_n_u8('\n')), vceqq_u8(v[i], vdupq_n_u8('\r'))));
+		control[i] = vcltq_u8(v[i], vdupq_n_u8(0x20));
+		high[i] = vcgeq_u8(v[i], vdupq_n_u8(0x80));
+	}
+	bc->quote = neon_mask64(quote[0], quote[1], quote[2], quote[3]);
+	bc->backslash = neon_mask64(backslash[0], backslash[1], backslash[2], backslash[3]);
+	bc->op = neon_mask64(op[0], op[1], op[2], op[3]);
+	bc->space = neon_mask64(space[0], space[1], space[2], space[3]);
+	bc->control = neon_mask64(control[0], control[1], control[2], control[3]);
+	bc->high = neon_mask64(high[0], high[1], high[2], high[3]);
+}
+#endif
+
+static AsciiRun ascii_run_impl;
+static PlainRun plain_run_impl;
+static Utf8Run utf8_run_impl;
+static Classify classify_impl;
+
+/*
+ * Pick the widest scanners the CPU supports, once: where the compiler
+ * allows, as the program starts, before any threads could race to.
+ */
+#ifdef __GNUC__
+__attribute__((constructor))
+#endif
+static void select_scanners(void)
+{
+	AsciiRun a = ascii_run_scalar;
+	PlainRun p = plain_run_scalar;
+	Utf8Run u = utf8_run_scalar;
+	Classify c = classify_scalar;
+	
+#if HAVE_X86_SCANNERS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		a = ascii_run_avx2;
+		p = plain_run_avx2;
+		u = utf8_run_avx2;
+		c = classify_avx2;
+	} else {
+		a = ascii_run_sse2;
+		p = plain_run_sse2;
+		if (__builtin_cpu_supports("ssse3"))
+			u = utf8_run_ssse3;
+		c = classify_sse2;
+	}
+#elif HAVE_NEON_SCANNERS
+	a = ascii_run_neon;
+	p = plain_run_neon;
+	u = utf8_run_neon;
+	c = classify_neon;
+#endif
+	ascii_run_impl = a;
+	plain_run_impl = p;
+	utf8_run_impl = u;
+	classify_impl = c;
+}
+
+static size_t ascii_run(const char *s, size_t n)
+{
+	if (ascii_run_impl == NULL)
+		select_scanners();
+	return ascii_run_impl(s, n);
+}
+
+static size_t plain_run(const char *s, size_t n, unsigned char last)
+{
+	if (plain_run_impl == NULL)
+		select_scanners();
+	return plain_run_impl(s, n, last);
+}
+
+static size_t utf8_run(const char *s, size_t n)
+{
+	if (utf8_run_impl == NULL)
+		select_scanners();
+	return utf8_run_impl(s, n);
+}
+
+static void classify(const char *s, BlockClass *bc)
+{
+	if (classify_impl == NULL)
+		select_scanners();
+	classify_impl(s, bc);
+}
+
+/*
+ * Unicode helper functions
+ *
+ * These are taken from the ccan/charset module and customized a bit.
+ * Putting them here means the compiler can (choose to) inline them,
+ * and it keeps ccan/json from having a dependency.
+ */
+
+/*
+ * Type for Unicode codepoints.
+ * We need our own because wchar_t might be 16 bits.
+ */
+typedef uint32_t js_uchar_t;
+
+/*
+ * Validate a single UTF-8 character starting at @s.
+ * The string must be null-terminated.
+ *
+ * If it's valid, return its length (1 thru 4).
+ * If it's invalid or clipped, return 0.
+ *
+ * This function implements the syntax given in RFC3629, which is
+ * the same as that given in The Unicode Standard, Version 6.0.
+ *
+ * It has the following properties:
+ *
+ *  * All codepoints U+0000..U+10FFFF may be encoded,
+ *    except for U+D800..U+DFFF, which are reserved
+ *    for UTF-16 surrogate pair encoding.
+ *  * UTF-8 byte sequences longer than 4 bytes are not permitted,
+ *    as they exceed the range of Unicode.
+ *  * The sixty-six Unicode "non-characters" are permitted
+ *    (namely, U+FDD0..U+FDEF, U+xxFFFE, and U+xxFFFF).
+ */
+static int utf8_validate_cz(const char *s)
+{
+	unsigned char c = *s++;
+	
+	if (c <= 0x7F) {        /* 00..7F */
+		return 1;
+	} else if (c <= 0xC1) { /* 80..C1 */
+		/* Disallow overlong 2-byte sequence. */
+		return 0;
+	} else if (c <= 0xDF) { /* C2..DF */
+		/* Make sure subsequent byte is in the range 0x80..0xBF. */
+		if (((unsigned char)*s++ & 0xC0) != 0x80)
+			return 0;
+		
+		return 2;
+	} else if (c <= 0xEF) { /* E0..EF */
+		/* Disallow overlong 3-byte sequence. */
+		if (c == 0xE0 && (unsigned char)*s < 0xA0)
+			return 0;
+		
+		/* Disallow U+D800..U+DFFF. */
+		if (c == 0xED && (unsigned char)*s > 0x9F)
+			return 0;
+		
+		/* Make sure subsequent bytes are in the range 0x80..0xBF. */
+		if (((unsigned char)*s++ & 0xC0) != 0x80)
+			return 0;
+		if (((unsigned char)*s++ & 0xC0) != 0x80)
+			return 0;
+		
+		return 3;
+	} else if (c <= 0xF4) { /* F0..F4 */
+		/* Disallow overlong 4-byte sequence. */
+		if (c == 0xF0 && (unsigned char)*s < 0x90)
+			return 0;
+		
+		/* Disallow codepoints beyond U+10FFFF. */
+		if (c == 0xF4 && (unsigned char)*s > 0x8F)
+			return 0;
+		
+		/* Make sure subsequent bytes are in the range 0x80..0xBF. */
+		if (((unsigned char)*s++ & 0xC0) != 0x80)
+			return 0;
+		if (((unsigned char)*s++ & 0xC0) != 0x80)
+			return 0;
+		if (((unsigned char)*s++ & 0xC0) != 0x80)
+			return 0;
+		
+		return 4;
+	} else {                /* F5..FF */
+		return 0;
+	}
+}
+
+/*
+ * Return the length of the longest valid UTF-8 prefix of s[0..n), which
+ * must be followed by a null.  The vector scanner checks whole blocks,
+ * multibyte characters and all, up to the first one with an error; from
+ * there, or where the CPU has no such scanner, ASCII runs are skipped and
+ * the other characters are checked one by one.
+ */
+static size_t utf8_valid_prefix(const char *s, size_t n)
+{
+	size_t i = utf8_run(s, n);
+	int len;
+	
+	for (;;) {
+		i += ascii_run(s + i, n - i);
+		if (i >= n)
+			return n;
+		do {
+			len = utf8_validate_cz(s + i);
+			if (len == 0)
+				return i;
+			i += len;
+		} while (i < n && (unsigned char)s[i] >= 0x80);
+	}
+}
+
+/* Validate a null-terminated UTF-8 string. */
+static bool utf8_validate(const char *s)
+{
+	size_t n = strlen(s);
+	
+	return utf8_valid_prefix(s, n) == n;
+}
+
+/*
+ * Read a single UTF-8 character starting at @s,
+ * returning the length, in bytes, of the character read.
+ *
+ * This function assumes input is valid UTF-8,
+ * and that there are enough characters in front of @s.
+ */
+static int utf8_read_char(const char *s, js_uchar_t *out)
+{
+	const unsigned char *c = (const unsigned char*) s;
+	
+	assert(utf8_validate_cz(s));
+
+	if (c[0] <= 0x7F) {
+		/* 00..7F */
+		*out = c[0];
+		return 1;
+	} else if (c[0] <= 0xDF) {
+		/* C2..DF (unless input is invalid) */
+		*out = ((js_uchar_t)c[0] & 0x1F) << 6 |
+		       ((js_uchar_t)c[1] & 0x3F);
+		return 2;
+	} else if (c[0] <= 0xEF) {
+		/* E0..EF */
+		*out = ((js_uchar_t)c[0] &  0xF) << 12 |
+		       ((js_uchar_t)c[1] & 0x3F) << 6  |
+		       ((js_uchar_t)c[2] & 0x3F);
+		return 3;
+	} else {
+		/* F0..F4 (unless input is invalid) */
+		*out = ((js_uchar_t)c[0] &  0x7) << 18 |
+		       ((js_uchar_t)c[1] & 0x3F) << 12 |
+		       ((js_uchar_t)c[2] & 0x3F) << 6  |
+		       ((js_uchar_t)c[3] & 0x3F);
+		return 4;
+	}
+}
+
+/*
+ * Write a single UTF-8 character to @s,
+ * returning the length, in bytes, of the character written.
+ *
+ * @unicode must be U+0000..U+10FFFF, but not U+D800..U+DFFF.
+ *
+ * This function will write up to 4 bytes to @out.
+ */
+static int utf8_write_char(js_uchar_t unicode, char *out)
+{
+	unsigned char *o = (unsigned char*) out;
+	
+	failx(
+		unicode <= 0x10FFFF && !(unicode >= 0xD800 && unicode <= 0xDFFF),
+		1,
+		"Illegal Unicode codepoint 0x%08X found",
+		unicode
+	);
+
+	if (unicode <= 0x7F) {
+		/* U+0000..U+007F */
+		*o++ = unicode;
+		return 1;
+	} else if (unicode <= 0x7FF) {
+		/* U+0080..U+07FF */
+		*o++ = 0xC0 | unicode >> 6;
+		*o++ = 0x80 | (unicode & 0x3F);
+		return 2;
+	} else if (unicode <= 0xFFFF) {
+		/* U+0800..U+FFFF */
+		*o++ = 0xE0 | unicode >> 12;
+		*o++ = 0x80 | (unicode >> 6 & 0x3F);
+		*o++ = 0x80 | (unicode & 0x3F);
+		return 3;
+	} else {
+		/* U+10000..U+10FFFF */
+		*o++ = 0xF0 | unicode >> 18;
+		*o++ = 0x80 | (unicode >> 12 & 0x3F);
+		*o++ = 0x80 | (unicode >> 6 & 0x3F);
+		*o++ = 0x80 | (unicode & 0x3F);
+		return 4;
+	}
+}
+
+/*
+ * Compute the Unicode codepoint of a UTF-16 surrogate pair.
+ *
+ * @uc should be 0xD800..0xDBFF, and @lc should be 0xDC00..0xDFFF.
+ * If they aren't, this function returns false.
+ */
+static bool from_surrogate_pair(uint16_t uc, uint16_t lc, js_uchar_t *unicode)
+{
+	if (uc >= 0xD800 && uc <= 0xDBFF && lc >= 0xDC00 && lc <= 0xDFFF) {
+		*unicode = 0x10000 + ((((js_uchar_t)uc & 0x3FF) << 10) | (lc & 0x3FF));
+		return true;
+	} else {
+		return false;
+	}
+}
+
+/*
+ * Construct a UTF-16 surrogate pair given a Unicode codepoint.
+ *
+ * @unicode must be U+10000..U+10FFFF.
+ */
+static void to_surrogate_pair(js_uchar_t unicode, uint16_t *uc, uint16_t *lc)
+{
+	js_uchar_t n;
+	
+	failx(
+		unicode >= 0x10000 && unicode <= 0x10FFFF,
+		1,
+		"Cannot construct UTF-16 surrogate pair for Unicode codepoint 0x%08X",
+		unicode
+	);
+	
+	n = unicode - 0x10000;
+	*uc = ((n >> 10) & 0x3FF) | 0xD800;
+	*lc = (n & 0x3FF) | 0xDC00;
+}
+
+#define is_space(c) ((c) == '\t' || (c) == '\n' || (c) == '\r' || (c) == ' ')
+#define is_digit(c) ((c) >= '0' && (c) <= '9')
+
+static bool parse_value     (const char **sp, JsonNode        **out);
+static bool parse_string    (const char **sp, char            **out);
+static bool parse_key       (const char **sp, char            **out, bool *interned);
+static bool parse_number    (const char **sp, double           *out);
+static bool parse_hex16     (const char **sp, uint16_t         *out);
+static int  parse_escape    (const char **sp, char             *out);
+
+static bool expect_literal  (const char **sp, const char *str);
+static void skip_space      (const char **sp);
+
+static void emit_value              (SB *out, const JsonNode *node, Indent *in);
+static void emit_leaf               (SB *out, const JsonNode *node, Indent *in, int depth);
+static void emit_string             (SB *out, const char *str, bool valid);
+static void emit_lazy_string        (SB *out, const JsonNode *node);
+static void emit_raw                (SB *out, const JsonNode *node);
+static void emit_tape               (SB *out, const JsonTape *tape, size_t i, Indent *in, int indent_level);
+static void emit_number             (SB *out, double num);
+
+static int write_hex16(char *out, uint16_t val);
+
+static JsonNode *mknode(JsonTag tag);
+static void append_node(JsonNode *parent, JsonNode *child);
+static void prepend_node(JsonNode *parent, JsonNode *child);
+static void insert_node(JsonNode *parent, JsonNode *child);
+static void append_member(JsonNode *object, char *key, JsonNode *value);
+static JsonNode *lookup_member(JsonNode *object, const char *key);
+static void index_free(JsonNode *object);
+static void build_children(const JsonNode *node);
+static bool index_validate(const char *json, size_t len);
+
+/* Are the children of this object or array yet to be made? */
+#define children_pending(node) ((node)->raw || (node)->on_tape)
+
+static void (*append_member_node_fn)(JsonNode *parent, JsonNode *child) = append_node;
+
+/* How deeply documents may nest; see json_set_max_depth */
+static size_t max_depth = JSON_MAX_DEPTH;
 
 /* Assertion-friendly validity checks */
 static bool tag_is_valid(unsigned int tag);
-static bool number_is_valid(const char *num);
 
-JsonNode *json_decode(const char *json)
+JsonNode *json_decode(const char *json)
+{
+	const char *s = json;
+	JsonNode *ret;
+	
+	skip_space(&s);
+	if (!parse_value(&s, &ret))
+		return NULL;
+	
+	skip_space(&s);
+	if (*s != 0) {
+		json_delete(ret);
+		return NULL;
+	}
+	
+	return ret;
+}
+
+/*
+ * Raw values
+ *
+ * json_decode_raw validates an object or array without building it: the
+ * node keeps the text, which compact output writes back out minified.
+ * The first time anything asks for the node's children, the text is
+ * decoded into them (build_children).  Other values are decoded as usual,
+ * and so is everything while members are deduplicated, since that has to
+ * look at every member as it is added.
+ */
+static JsonNode *decode_raw(const char *json, bool copy, bool check)
+{
+	const char *s = json, *end = json + strlen(json);
+	JsonNode *ret;
+	
+	if (check && !index_validate(json, end - json))
+		return NULL;
+	
+	skip_space(&s);
+	if ((*s != '{' && *s != '[') || append_member_node_fn != append_node)
+		return json_decode(json);
+	
+	while (is_space(end[-1]))
+		end--;
+	
+	ret = mknode(*s == '{' ? JSON_OBJECT : JSON_ARRAY);
+	ret->raw = 1;
+	ret->raw_.len = end - s;
+	if (copy) {
+		ret->raw_.text = node_strndup(ret, s, end - s);
+	} else {
+		ret->raw_.text = (char*) s;
+		ret->borrowed = 1;
+	}
+	return ret;
+}
+
+/* Like json_decode, but keep an object or array as (a copy of) its text */
+JsonNode *json_decode_raw(const char *json)
+{
+	return decode_raw(json, true, true);
+}
+
+/* Like json_decode_raw, but refer to @json, which must outlive the node */
+JsonNode *json_decode_raw_ref(const char *json)
+{
+	return decode_raw(json, false, true);
+}
+
+/* Like json_decode_raw_ref, for @json that json_validate has accepted */
+JsonNode *json_decode_raw_checked(const char *json)
+{
+	return decode_raw(json, false, false);
+}
+
+/* Give a raw node the children its text describes. */
+static void raw_materialize(JsonNode *node)
+{
+	JsonNode *tmp, *child;
+	const char *s = node->raw_.text;
+	bool free_text = !node->arena && !node->borrowed;
+	char *text = node->raw_.text;
+	
+	if (!parse_value(&s, &tmp))
+		assert(false);	/* validated by decode_raw */
+	
+	node->raw = 0;
+	node->borrowed = 0;
+	node->children.head = tmp->children.head;
+	node->children.tail = tmp->children.tail;
+	node->children.index = tmp->children.index;
+	for (child = node->children.head; child != NULL; child = child->next)
+		child->parent = node;
+	if (!tmp->arena)
+		free(tmp);
+	if (free_text)
+		free(text);
+}
+
+char *json_encode(const JsonNode *node)
+{
+	return json_stringify(node, NULL);
+}
+
+char *json_encode_string(const char *str)
+{
+	SB sb;
+	sb_init(&sb);
+	
+	emit_string(&sb, str, false);
+	
+	return sb_finish(&sb);
+}
+
+char *json_stringify(const JsonNode *node, const char *space)
+{
+	SB sb;
+	Indent in;
+	sb_init(&sb);
+	
+	indent_init(&in, space);
+	emit_value(&sb, node, &in);
+	indent_free(&in);
+	
+	/* a lazy string's reader failed */
+	if (sb.failed) {
+		sb_free(&sb);
+		return NULL;
+	}
+	return sb_finish(&sb);
+}
+
+bool json_write(FILE *fp, const JsonNode *node, const char *space)
+{
+	SB sb;
+	Indent in;
+	bool ok;
+	
+	sb_init_stream(&sb, fp);
+	
+	indent_init(&in, space);
+	emit_value(&sb, node, &in);
+	indent_free(&in);
+	
+	sb_flush(&sb);
+	ok = !sb.failed;
+	sb_free(&sb);
+	return ok;
+}
+
+/* Free @node itself, and what it owns other than its key and children. */
+static void free_node(JsonNode *node)
+{
+	switch (node->tag) {
+		case JSON_STRING:
+			if (!node->arena && !node->borrowed && !node->lazy)
+				free(node->string_);
+			break;
+		case JSON_NUMBER:
+			if (!node->arena && !node->borrowed)
+				free(node->number_text_);
+			break;
+		case JSON_ARRAY:
+		case JSON_OBJECT:
+			if (node->raw) {
+				if (!node->arena && !node->borrowed)
+					free(node->raw_.text);
+			} else if (!node->on_tape) {
+				index_free(node);
+			}
+			break;
+		default:;
+	}
+	
+	if (!node->arena)
+		free(node);
+}
+
+/*
+ * Free the tree bottom-up, without recursing: go down to the first leaf,
+ * free it, and go on to its next sibling, or back up to its parent, which
+ * then has no children left and is a leaf itself.
+ */
+void json_delete(JsonNode *node)
+{
+	JsonNode *at = node, *parent, *next;
+	
+	if (node == NULL)
+		return;
+	json_remove_from_parent(node);
+	
+	for (;;) {
+		while ((at->tag == JSON_ARRAY || at->tag == JSON_OBJECT) &&
+		       !children_pending(at) && at->children.head != NULL)
+			at = at->children.head;
+		
+		if (at == node) {
+			free_node(at);
+			return;
+		}
+		
+		parent = at->parent;
+		next = at->next;
+		if (!at->arena && !at->key_interned)
+			free(at->key);
+		free_node(at);
+		if (next != NULL) {
+			at = next;
+		} else {
+			parent->children.head = NULL;
+			at = parent;
+		}
+	}
+}
+
+/*
+ * Is @num a JSON number, and nothing else, that a double can hold
+ * (i.e. that doesn't overflow to infinity)?
+ */
+bool json_validate_number(const char *num)
+{
+	const char *s = num;
+	long mag = -1, exp = 0;
+	bool neg = false;
+	
+	if (!parse_number(&s, NULL) || *s != 0)
+		return false;
+	
+	/* Only magnitudes from 10^308 up can overflow; estimate it first */
+	s = num;
+	if (*s == '-')
+		s++;
+	while (*s == '0')
+		s++;
+	while (is_digit(*s)) {
+		mag++;
+		s++;
+	}
+	if (*s == '.') {
+		s++;
+		if (mag < 0) {
+			while (*s == '0') {
+				mag--;
+				s++;
+			}
+		}
+		while (is_digit(*s))
+			s++;
+	}
+	if (*s == 'e' || *s == 'E') {
+		s++;
+		if (*s == '+' || *s == '-')
+			neg = (*s++ == '-');
+		while (is_digit(*s) && exp < 100000)
+			exp = exp * 10 + (*s++ - '0');
+		if (neg)
+			exp = -exp;
+	}
+	if (mag + exp < 308)
+		return true;
+	return isfinite(strtod(num, NULL));
+}
+
+/*
+ * Structural index
+ *
+ * json_validate finds its way through a document the way simdjson does,
+ * in two stages.  The first classifies 64 bytes at a time (see classify)
+ * and turns the masks into the positions of the bytes that matter: the
+ * structural characters and the opening quotes outside strings, and the
+ * first byte of every number or literal.  Which quotes are escaped and
+ * which bytes are inside strings is worked out with bit arithmetic, and
+ * the contents of strings are checked on the way: control characters
+ * are caught by mask, and UTF-8 characters and escape sequences are
+ * decoded where there are any.  The second stage checks the grammar by
+ * walking the positions, looking at each number and literal but never
+ * inside a string.
+ */
+
+/* Positions found per call to index_blocks: 16 blocks of 64 bytes */
+#define INDEX_BLOCKS	16
+
+typedef struct {
+	const char *json;
+	size_t len;
+	size_t at;                /* start of the next block to classify */
+	uint64_t escaped;         /* bit 0: the next block starts escaped */
+	uint64_t in_string;       /* all ones if it starts inside a string */
+	uint64_t scalar;          /* bit 0: ... in a number or literal */
+	size_t escape_end;        /* end of the last escape sequence checked */
+	size_t utf8_end;          /* end of the last UTF-8 character checked */
+	bool bad;                 /* a string is invalid, or has no end */
+	size_t pos[INDEX_BLOCKS * 64];
+	size_t count;
+} StructIndex;
+
+/* Bit i is set if an odd number of bits 0..i of x are. */
+static uint64_t prefix_xor(uint64_t x)
+{
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+	return x;
+}
+
+/* Characters escaped by the backslashes in a block (from simdjson) */
+static uint64_t find_escaped(uint64_t backslash, uint64_t *carry)
+{
+	const uint64_t even_bits = 0x5555555555555555ULL;
+	uint64_t escaped = *carry, follows_escape, odd_starts, even_runs;
+	
+	backslash &= ~escaped;
+	follows_escape = backslash << 1 | escaped;
+	odd_starts = backslash & ~even_bits & ~follows_escape;
+	even_runs = odd_starts + backslash;
+	*carry = even_runs < odd_starts;
+	return (even_bits ^ (even_runs << 1)) & follows_escape;
+}
+
+/* Refill ix->pos from the next blocks; false at the end of the input. */
+static bool index_blocks(StructIndex *ix)
+{
+	char tail[64];
+	int n;
+	
+	ix->count = 0;
+	for (n = 0; n < INDEX_BLOCKS && ix->at < ix->len; n++, ix->at += 64) {
+		const char *block = ix->json + ix->at;
+		uint64_t escaped, quote, in_string, other, bits;
+		BlockClass bc;
+		
+		if (ix->len - ix->at < 64) {
+			/* pad the last block with spaces */
+			memset(tail, ' ', 64);
+			memcpy(tail, block, ix->len - ix->at);
+			block = tail;
+		}
+		classify(block, &bc);
+		
+		escaped = (bc.backslash | ix->escaped) != 0 ? find_escaped(bc.backslash, &ix->escaped) : 0;
+		quote = bc.quote & ~escaped;
+		in_string = prefix_xor(quote) ^ ix->in_string;
+		ix->in_string = (uint64_t) ((int64_t) in_string >> 63);
+		if (bc.control & in_string)
+			ix->bad = true;
+		
+		/* Check each UTF-8 character where it starts */
+		for (bits = bc.high; bits != 0; bits &= bits - 1) {
+			size_t at = ix->at + __builtin_ctzll(bits);
+			int len;
+			
+			if (at < ix->utf8_end)
+				continue;
+			if ((len = utf8_validate_cz(ix->json + at)) == 0) {
+				ix->bad = true;
+				break;
+			}
+			ix->utf8_end = at + len;
+		}
+		
+		/* Decode each escape sequence, skipping the second half of a surrogate pair */
+		for (bits = bc.backslash & ~escaped & in_string; bits != 0; bits &= bits - 1) {
+			const char *e = ix->json + ix->at + __builtin_ctzll(bits) + 1;
+			char decoded[4];
+			
+			if ((size_t) (e - ix->json) <= ix->escape_end)
+				continue;
+			if (parse_escape(&e, decoded) == 0)
+				ix->bad = true;
+			ix->escape_end = e - ix->json;
+		}
+		
+		other = ~(bc.op | bc.space | bc.quote | in_string);
+		bits = (bc.op & ~in_string) | (quote & in_string) | (other & ~(other << 1 | ix->scalar));
+		ix->scalar = other >> 63;
+		
+		while (bits != 0) {
+			ix->pos[ix->count++] = ix->at + __builtin_ctzll(bits);
+			bits &= bits - 1;
+		}
+	}
+	if (ix->at >= ix->len && ix->in_string)
+		ix->bad = true;
+	return ix->count > 0;
+}
+
+/* Point *next and *end at the next positions found; false at the end. */
+static bool index_refill(StructIndex *ix, const size_t **next, const size_t **end)
+{
+	if (!index_blocks(ix))
+		return false;
+	*next = ix->pos;
+	*end = ix->pos + ix->count;
+	return true;
+}
+
+/* Check the number or literal at @p. */
+static bool index_scalar(const char *json, size_t p)
+{
+	const char *s = json + p;
+	bool ok;
+	
+	switch (*s) {
+		case 'n':
+			ok = expect_literal(&s, "null");
+			break;
+		case 't':
+			ok = expect_literal(&s, "true");
+			break;
+		case 'f':
+			ok = expect_literal(&s, "false");
+			break;
+		default:
+			ok = parse_number(&s, NULL);
+	}
+	if (!ok)
+		return false;
+	
+	/* It must end where the first stage thought it did */
+	switch (*s) {
+		case 0: case ' ': case '\t': case '\n': case '\r':
+		case '{': case '}': case '[': case ']': case ':': case ',': case '"':
+			return true;
+		default:
+			return false;
+	}
+}
+
+/* Is json[0..len) (followed by a null) one JSON value? */
+static bool index_validate(const char *json, size_t len)
+{
+	StructIndex *ix;
+	char small_stack[64], *stack = small_stack;
+	size_t depth = 0, stack_size = sizeof(small_stack), p;
+	const size_t *next = NULL, *end = NULL;
+	bool ok = false;
+	
+	/* The position of the next structural, or the end of the input */
+	#define next_pos() \
+		(next < end || index_refill(ix, &next, &end) ? *next++ : len)
+	
+	ix = (StructIndex*) malloc(sizeof(StructIndex));
+	if (ix == NULL)
+		out_of_memory();
+	ix->json = json;
+	ix->len = len;
+	ix->at = 0;
+	ix->escaped = ix->in_string = ix->scalar = 0;
+	ix->escape_end = ix->utf8_end = 0;
+	ix->bad = false;
+	ix->count = 0;
+	
+	p = next_pos();
+	for (;;) {
+		/* A value starts at p */
+		switch (json[p]) {
+			case '{':
+			case '[':
+				if (max_depth != 0 && depth == max_depth)
+					goto done;
+				if (depth == stack_size) {
+					char *grown = (char*) malloc(stack_size * 2);
+					if (grown == NULL)
+						out_of_memory();
+					memcpy(grown, stack, depth);
+					if (stack != small_stack)
+						free(stack);
+					stack = grown;
+					stack_size *= 2;
+				}
+				stack[depth++] = json[p];
+				p = next_pos();
+				if (json[p] == (stack[depth - 1] == '{' ? '}' : ']')) {
+					depth--;
+					break;
+				}
+				if (stack[depth - 1] == '[')
+					continue;
+				goto key;
+			case '"':
+				break;
+			case '}':
+			case ']':
+			case ':':
+			case ',':
+			case 0:
+				goto done;
+			default:
+				if (!index_scalar(json, p))
+					goto done;
+		}
+		
+		/* After a value: a comma, the end of its container, or the end */
+		for (;;) {
+			p = next_pos();
+			if (depth == 0) {
+				ok = p == len && !ix->bad;
+				goto done;
+			}
+			if (json[p] != (stack[depth - 1] == '{' ? '}' : ']'))
+				break;
+			depth--;
+		}
+		if (json[p] != ',')
+			goto done;
+		p = next_pos();
+		if (stack[depth - 1] == '[')
+			continue;
+		
+	key:
+		if (json[p] != '"')
+			goto done;
+		if (json[next_pos()] != ':')
+			goto done;
+		p = next_pos();
+	}
+
+done:
+	if (stack != small_stack)
+		free(stack);
+	free(ix);
+	return ok;
+	
+	#undef next_pos
+}
+
+bool json_validate(const char *json)
+{
+	return index_validate(json, strlen(json));
+}
+
+void json_set_max_depth(size_t depth)
+{
+	max_depth = depth;
+}
+
+/*
+ * Key table
+ *
+ * Object keys repeat: every element of an array of records carries the
+ * same few.  Short keys are interned here, so that every member with a
+ * given key shares one copy, which also holds the key's escaped form
+ * ("key":) for output to copy as it is.  Interned keys belong to the
+ * table, which lives as long as the process; once it is full, further
+ * keys are copied for each member as before.
+ */
+
+#define KEY_INTERN_MAX_LEN	64
+#define KEY_INTERN_MAX_COUNT	4096
+
+typedef struct
+{
+	size_t hash;
+	size_t len;
+	const char *escaped;  /* "key": */
+	size_t escaped_len;
+	char text[];          /* the key, then the escaped form */
+} InternedKey;
+
+static struct
+{
+	InternedKey **keys;   /* by id, in the order they were added */
+	size_t count;
+	unsigned int *slots;  /* id + 1, or 0 if empty */
+	size_t mask;          /* number of slots - 1 */
+} key_table;
+
+#define interned_key(key) \
+	((const InternedKey *) ((key) - offsetof(InternedKey, text)))
+
+static void key_table_grow(void)
+{
+	size_t size = key_table.slots == NULL ? 256 : (key_table.mask + 1) * 2, i;
+	unsigned int *slots = (unsigned int*) calloc(size, sizeof(unsigned int));
+	InternedKey **keys = (InternedKey**) realloc(key_table.keys, size / 2 * sizeof(InternedKey*));
+	
+	if (slots == NULL || keys == NULL)
+		out_of_memory();
+	for (i = 0; i < key_table.count; i++) {
+		size_t at = keys[i]->hash & (size - 1);
+		
+		while (slots[at] != 0)
+			at = (at + 1) & (size - 1);
+		slots[at] = i + 1;
+	}
+	free(key_table.slots);
+	key_table.keys = keys;
+	key_table.slots = slots;
+	key_table.mask = size - 1;
+}
+
+/*
+ * The id of the interned copy of @key[0..len), which must be valid UTF-8,
+ * adding it to the table if need be; -1 if it can't be interned.
+ */
+static long intern_key(const char *key, size_t len)
+{
+	size_t hash = (size_t) 2166136261u, at, i;
+	InternedKey *ik;
+	SB sb;
+	
+	if (len > KEY_INTERN_MAX_LEN)
+		return -1;
+	for (i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+	
+	if (key_table.slots != NULL) {
+		for (at = hash & key_table.mask; key_table.slots[at] != 0; at = (at + 1) & key_table.mask) {
+			ik = key_table.keys[key_table.slots[at] - 1];
+			if (ik->hash == hash && ik->len == len && memcmp(ik->text, key, len) == 0)
+				return key_table.slots[at] - 1;
+		}
+	}
+	
+	if (key_table.count == KEY_INTERN_MAX_COUNT)
+		return -1;
+	if (key_table.slots == NULL || key_table.count >= (key_table.mask + 1) / 2)
+		key_table_grow();
+	
+	ik = (InternedKey*) malloc(sizeof(InternedKey) + len + 1);
+	if (ik == NULL)
+		out_of_memory();
+	memcpy(ik->text, key, len);
+	ik->text[len] = 0;
+	
+	sb_init(&sb);
+	emit_string(&sb, ik->text, true);
+	sb_putc(&sb, ':');
+	ik->escaped_len = sb.cur - sb.start;
+	ik = (InternedKey*) realloc(ik, sizeof(InternedKey) + len + 1 + ik->escaped_len + 1);
+	if (ik == NULL)
+		out_of_memory();
+	memcpy(ik->text + len + 1, sb.start, ik->escaped_len);
+	ik->text[len + 1 + ik->escaped_len] = 0;
+	ik->escaped = ik->text + len + 1;
+	ik->hash = hash;
+	ik->len = len;
+	sb_free(&sb);
+	
+	for (at = hash & key_table.mask; key_table.slots[at] != 0; at = (at + 1) & key_table.mask)
+		;
+	key_table.slots[at] = key_table.count + 1;
+	key_table.keys[key_table.count] = ik;
+	return key_table.count++;
+}
+
+/*
+ * Give @node the key @key[0..len), which must be valid UTF-8: the
+ * interned copy if there is one, or else a copy of its own.
+ */
+static void set_key(JsonNode *node, const char *key, size_t len)
+{
+	long id = intern_key(key, len);
+	
+	if (id >= 0) {
+		node->key = key_table.keys[id]->text;
+		node->key_interned = 1;
+	} else {
+		node->key = node_strndup(node, key, len);
+	}
+	node->validated = 1;
+}
+
+/* Give @node a copy of the key @key, which may be any string. */
+static void member_key(JsonNode *node, const char *key)
+{
+	size_t len = strlen(key);
+	
+	if (len <= KEY_INTERN_MAX_LEN && utf8_valid_prefix(key, len) == len)
+		set_key(node, key, len);
+	else {
+		node->key = node_strdup(node, key);
+		node->validated = 1;
+	}
+}
+
+/* Drop @node's key, freeing it if the node owns it. */
+static void clear_key(JsonNode *node)
+{
+	if (!node->arena && !node->key_interned)
+		free(node->key);
+	node->key = NULL;
+	node->key_interned = 0;
+}
+
+/* Write @member's key and the colon after it. */
+static void emit_key(SB *out, const JsonNode *member, const char *space)
+{
+	if (member->key_interned) {
+		const InternedKey *ik = interned_key(member->key);
+		
+		sb_put(out, ik->escaped, ik->escaped_len);
+	} else {
+		emit_string(out, member->key, member->validated);
+		sb_putc(out, ':');
+	}
+	if (space != NULL)
+		sb_putc(out, ' ');
+}
+
+/*
+ * Tapes
+ *
+ * Each entry is a 64-bit word: the kind of entry in the top byte, and
+ * below it
+ *
+ *   '{' '['    the index of the matching '}' or ']'
+ *   '}' ']'    the index of the matching '{' or '['
+ *   'k' '"'    (a key or string) the offset of its text in strings
+ *   'K'        (a key in the key table) its id there
+ *   '0'        (a number) the offset of its text in strings
+ *   't' 'f' 'n'  nothing
+ *
+ * Entry 0 is a header, so that 0 can stand for "no value".  Texts are
+ * stored as a size_t length, the bytes and a null; strings are decoded,
+ * numbers are kept as written.  In an object, each value comes right
+ * after the 'k' entry of its key.
+ */
+
+#define TAPE_ENTRY(kind, value)	(((uint64_t)(unsigned char)(kind) << 56) | (uint64_t)(value))
+#define TAPE_KIND(entry)	((unsigned char)((entry) >> 56))
+#define TAPE_VALUE(entry)	((size_t)((entry) & (((uint64_t)1 << 56) - 1)))
+#define TAPE_IS_KEY(kind)	((kind) == 'k' || (kind) == 'K')
+
+struct JsonTape
+{
+	uint64_t *entries;
+	size_t count, alloc;
+	SB strings;
+};
+
+static size_t tape_push(JsonTape *tape, char kind, size_t value)
+{
+	if (tape->count == tape->alloc) {
+		tape->alloc *= 2;
+		tape->entries = (uint64_t*) realloc(tape->entries, tape->alloc * sizeof(uint64_t));
+		if (tape->entries == NULL)
+			out_of_memory();
+	}
+	tape->entries[tape->count] = TAPE_ENTRY(kind, value);
+	return tape->count++;
+}
+
+static JsonTape *tape_new(void)
+{
+	JsonTape *tape = (JsonTape*) malloc(sizeof(JsonTape));
+	
+	if (tape == NULL)
+		out_of_memory();
+	tape->count = 0;
+	tape->alloc = 64;
+	tape->entries = (uint64_t*) malloc(tape->alloc * sizeof(uint64_t));
+	if (tape->entries == NULL)
+		out_of_memory();
+	sb_init(&tape->strings);
+	tape_push(tape, 'r', 0);
+	return tape;
+}
+
+/* Put @text[0..len) on the tape as a @kind entry. */
+static void tape_text(JsonTape *tape, char kind, const char *text, size_t len)
+{
+	SB *sb = &tape->strings;
+	size_t offset = sb->cur - sb->start;
+	
+	sb_put(sb, (const char*) &len, sizeof(size_t));
+	sb_put(sb, text, len);
+	sb_putc(sb, 0);
+	tape_push(tape, kind, offset);
+}
+
+/*
+ * Close the object or array open at *@open: point it at its end, and go
+ * back to the one it is in, whose index its entry held until now.
+ */
+static void tape_close(JsonTape *tape, size_t *open)
+{
+	unsigned char kind = TAPE_KIND(tape->entries[*open]);
+	size_t close = tape_push(tape, kind == '{' ? '}' : ']', *open);
+	size_t outer = TAPE_VALUE(tape->entries[*open]);
+	
+	tape->entries[*open] = TAPE_ENTRY(kind, close);
+	*open = outer;
+}
+
+/* Decode the string at *sp onto the tape as a @kind entry. */
+static bool tape_string(JsonTape *tape, const char **sp, const char *end, char kind)
+{
+	SB *sb = &tape->strings;
+	const char *s = *sp + 1;
+	size_t offset = sb->cur - sb->start, len;
+	
+	sb_need(sb, sizeof(size_t));
+	sb->cur += sizeof(size_t);
+	
+	for (;;) {
+		/* Copy plain characters in one go, then decode the one after them */
+		size_t run = plain_run(s, end - s, 0xFF);
+		
+		if (utf8_valid_prefix(s, run) != run)
+			return false;
+		sb_put(sb, s, run);
+		s += run;
+		
+		if (*s == '"')
+			break;
+		if (*s != '\\')
+			return false; /* control character, or end of input */
+		
+		s++;
+		sb_need(sb, 4);
+		if ((len = parse_escape(&s, sb->cur)) == 0)
+			return false;
+		sb->cur += len;
+	}
+	
+	len = sb->cur - sb->start - offset - sizeof(size_t);
+	memcpy(sb->start + offset, &len, sizeof(size_t));
+	sb_putc(sb, 0);
+	tape_push(tape, kind, offset);
+	*sp = s + 1;
+	return true;
+}
+
+static bool tape_number(JsonTape *tape, const char **sp)
+{
+	const char *s = *sp;
+	
+	if (!parse_number(&s, NULL))
+		return false;
+	
+	tape_text(tape, '0', *sp, s - *sp);
+	*sp = s;
+	return true;
+}
+
+/* Decode the key at *sp and the colon after it. */
+static bool tape_key(JsonTape *tape, const char **sp, const char *end)
+{
+	const char *s = *sp, *key;
+	size_t len;
+	long id;
+	
+	if (*s != '"' || !tape_string(tape, &s, end, 'k'))
+		return false;
+	
+	/* Keep only the id of a key that can be interned */
+	key = json_tape_text(tape, tape->count - 1, &len);
+	if ((id = intern_key(key, len)) >= 0) {
+		tape->strings.cur = tape->strings.start + TAPE_VALUE(tape->entries[tape->count - 1]);
+		tape->entries[tape->count - 1] = TAPE_ENTRY('K', id);
+	}
+	skip_space(&s);
+	if (*s++ != ':')
+		return false;
+	skip_space(&s);
+	*sp = s;
+	return true;
+}
+
+/*
+ * Decode @json onto a new tape, or return NULL if it isn't valid JSON.
+ *
+ * This does not recurse: until an object or array is closed, its entry
+ * holds the index of the one it is in, so the entries themselves are the
+ * stack of open containers.
+ */
+JsonTape *json_tape_decode(const char *json)
 {
 	const char *s = json;
-	JsonNode *ret;
+	const char *end = json + strlen(json);
+	JsonTape *tape = tape_new();
+	size_t open = 0, depth = 0;
+	bool value = true; /* a value is due (else a comma or closing bracket) */
+	char kind = 0;     /* '{' or '[' when open != 0 */
 	
 	skip_space(&s);
-	if (!parse_value(&s, &ret))
-		return NULL;
+	for (;;) {
+		if (value) {
+			switch (*s) {
+				case '{':
+				case '[':
+					if (max_depth != 0 && depth == max_depth)
+						goto failed;
+					depth++;
+					kind = *s++;
+					open = tape_push(tape, kind, open);
+					skip_space(&s);
+					if (*s == (kind == '{' ? '}' : ']'))
+						value = false;
+					else if (kind == '{' && !tape_key(tape, &s, end))
+						goto failed;
+					continue;
+				case '"':
+					if (!tape_string(tape, &s, end, '"'))
+						goto failed;
+					break;
+				case 'n':
+					if (!expect_literal(&s, "null"))
+						goto failed;
+					tape_push(tape, 'n', 0);
+					break;
+				case 't':
+					if (!expect_literal(&s, "true"))
+						goto failed;
+					tape_push(tape, 't', 0);
+					break;
+				case 'f':
+					if (!expect_literal(&s, "false"))
+						goto failed;
+					tape_push(tape, 'f', 0);
+					break;
+				default:
+					if (!tape_number(tape, &s))
+						goto failed;
+			}
+			value = false;
+		} else if (open == 0) {
+			break;
+		} else if (*s == ',') {
+			s++;
+			skip_space(&s);
+			if (kind == '{' && !tape_key(tape, &s, end))
+				goto failed;
+			value = true;
+			continue;
+		} else if (*s == (kind == '{' ? '}' : ']')) {
+			s++;
+			tape_close(tape, &open);
+			depth--;
+			kind = open != 0 ? TAPE_KIND(tape->entries[open]) : 0;
+		} else {
+			goto failed;
+		}
+		skip_space(&s);
+	}
 	
-	skip_space(&s);
-	if (*s != 0) {
-		json_delete(ret);
+	if (*s != 0)
+		goto failed;
+	return tape;
+
+failed:
+	json_tape_free(tape);
+	return NULL;
+}
+
+void json_tape_free(JsonTape *tape)
+{
+	if (tape != NULL) {
+		free(tape->entries);
+		sb_free(&tape->strings);
+		free(tape);
+	}
+}
+
+/* Index of the entry after value @i (and everything in it) */
+static size_t tape_skip(const JsonTape *tape, size_t i)
+{
+	unsigned char kind = TAPE_KIND(tape->entries[i]);
+	
+	return kind == '{' || kind == '[' ? TAPE_VALUE(tape->entries[i]) + 1 : i + 1;
+}
+
+/* The value at entry @i, if there is one there, or 0 */
+static size_t tape_value_at(const JsonTape *tape, size_t i)
+{
+	if (i >= tape->count)
+		return 0;
+	switch (TAPE_KIND(tape->entries[i])) {
+		case '}':
+		case ']':
+			return 0;
+		case 'k':
+		case 'K':
+			return i + 1;
+		default:
+			return i;
+	}
+}
+
+JsonTag json_tape_tag(const JsonTape *tape, size_t i)
+{
+	switch (TAPE_KIND(tape->entries[i])) {
+		case '{':
+			return JSON_OBJECT;
+		case '[':
+			return JSON_ARRAY;
+		case '"':
+			return JSON_STRING;
+		case '0':
+			return JSON_NUMBER;
+		case 't':
+		case 'f':
+			return JSON_BOOL;
+		default:
+			return JSON_NULL;
+	}
+}
+
+/* The first value in object or array @i, or 0 if it is empty */
+size_t json_tape_first(const JsonTape *tape, size_t i)
+{
+	unsigned char kind = TAPE_KIND(tape->entries[i]);
+	
+	if (kind != '{' && kind != '[')
+		return 0;
+	return tape_value_at(tape, i + 1);
+}
+
+/* The value after @i in the same object or array, or 0 */
+size_t json_tape_next(const JsonTape *tape, size_t i)
+{
+	return tape_value_at(tape, tape_skip(tape, i));
+}
+
+/* The key of object member @i, or NULL if @i is not one */
+const char *json_tape_key(const JsonTape *tape, size_t i)
+{
+	if (!TAPE_IS_KEY(TAPE_KIND(tape->entries[i - 1])))
 		return NULL;
+	return json_tape_text(tape, i - 1, NULL);
+}
+
+/* The contents of string @i, or number @i as written */
+const char *json_tape_text(const JsonTape *tape, size_t i, size_t *len)
+{
+	const char *text = tape->strings.start + TAPE_VALUE(tape->entries[i]);
+	
+	if (TAPE_KIND(tape->entries[i]) == 'K') {
+		const InternedKey *ik = key_table.keys[TAPE_VALUE(tape->entries[i])];
+		
+		if (len != NULL)
+			*len = ik->len;
+		return ik->text;
 	}
+	assert(strchr("k\"0", TAPE_KIND(tape->entries[i])) != NULL);
+	if (len != NULL)
+		memcpy(len, text, sizeof(size_t));
+	return text + sizeof(size_t);
+}
+
+bool json_tape_bool(const JsonTape *tape, size_t i)
+{
+	return TAPE_KIND(tape->entries[i]) == 't';
+}
+
+/* A node for value @i; see json_tape_node */
+static JsonNode *tape_value(const JsonTape *tape, size_t i)
+{
+	JsonNode *node;
 	
-	return ret;
+	switch (TAPE_KIND(tape->entries[i])) {
+		case '{':
+		case '[':
+			node = mknode(json_tape_tag(tape, i));
+			node->on_tape = 1;
+			node->tape_.tape = tape;
+			node->tape_.index = i;
+			/* Duplicate members are dropped as they are added */
+			if (append_member_node_fn != append_node)
+				build_children(node);
+			return node;
+		case '"':
+			node = mknode(JSON_STRING);
+			node->string_ = (char*) json_tape_text(tape, i, NULL);
+			node->borrowed = 1;
+			node->validated = 1;
+			return node;
+		case '0':
+			node = mknode(JSON_NUMBER);
+			node->number_text_ = (char*) json_tape_text(tape, i, NULL);
+			node->borrowed = 1;
+			return node;
+		case 't':
+		case 'f':
+			return json_mkbool(json_tape_bool(tape, i));
+		default:
+			return json_mknull();
+	}
 }
 
-char *json_encode(const JsonNode *node)
+JsonNode *json_tape_node(const JsonTape *tape, size_t i)
 {
-	return json_stringify(node, NULL);
+	return tape_value(tape, i);
 }
 
-char *json_encode_string(const char *str)
+/* Give a node made by json_tape_node the children it has on the tape. */
+static void tape_materialize(JsonNode *node)
 {
-	SB sb;
-	sb_init(&sb);
+	const JsonTape *tape = node->tape_.tape;
+	size_t at = node->tape_.index, i, len;
 	
-	emit_string(&sb, str);
+	node->on_tape = 0;
+	node->children.head = node->children.tail = NULL;
+	node->children.index = NULL;
 	
-	return sb_finish(&sb);
+	json_tape_foreach(i, tape, at) {
+		JsonNode *child = tape_value(tape, i);
+		
+		if (node->tag == JSON_OBJECT) {
+			const char *key = json_tape_text(tape, i - 1, &len);
+			set_key(child, key, len);
+			append_member_node_fn(node, child);
+		} else {
+			append_node(node, child);
+		}
+	}
 }
 
-char *json_stringify(const JsonNode *node, const char *space)
+/* Make the children of @node, in the arena it lives in. */
+static void build_children(const JsonNode *node)
 {
-	SB sb;
-	sb_init(&sb);
+	JsonArena *arena = json_arena_use(node->arena);
 	
-	if (space != NULL)
-		emit_value_indented(&sb, node, space, 0);
+	if (node->raw)
+		raw_materialize((JsonNode*) node);
+	else if (node->on_tape)
+		tape_materialize((JsonNode*) node);
+	json_arena_use(arena);
+}
+
+/* Put the key @key on the tape, by its id if it can be interned. */
+static void tape_put_key(JsonTape *tape, const char *key)
+{
+	size_t len = strlen(key);
+	long id = intern_key(key, len);
+	
+	if (id >= 0)
+		tape_push(tape, 'K', id);
 	else
-		emit_value(&sb, node);
+		tape_text(tape, 'k', key, len);
+}
+
+/* Put the scalar @node on the tape. */
+static void tape_put_scalar(JsonTape *tape, const JsonNode *node)
+{
+	SB *sb = &tape->strings;
+	size_t offset, len;
 	
-	return sb_finish(&sb);
+	switch (node->tag) {
+		case JSON_NULL:
+			tape_push(tape, 'n', 0);
+			break;
+		case JSON_BOOL:
+			tape_push(tape, node->bool_ ? 't' : 'f', 0);
+			break;
+		case JSON_STRING:
+			assert(!node->lazy);
+			tape_text(tape, '"', node->string_, strlen(node->string_));
+			break;
+		case JSON_NUMBER:
+			if (node->number_text_ != NULL) {
+				tape_text(tape, '0', node->number_text_, strlen(node->number_text_));
+			} else if (!isfinite(node->number_)) {
+				tape_push(tape, 'n', 0);	/* as emit_number writes it */
+			} else {
+				/* Format it in place, then fill in its length */
+				offset = sb->cur - sb->start;
+				sb_need(sb, sizeof(size_t));
+				sb->cur += sizeof(size_t);
+				emit_number(sb, node->number_);
+				len = sb->cur - sb->start - offset - sizeof(size_t);
+				memcpy(sb->start + offset, &len, sizeof(size_t));
+				sb_putc(sb, 0);
+				tape_push(tape, '0', offset);
+			}
+			break;
+		default:
+			assert(false);
+	}
 }
 
-void json_delete(JsonNode *node)
+/* Copy value @i of @src, and everything in it, onto the tape. */
+static void tape_copy(JsonTape *tape, const JsonTape *src, size_t i)
+{
+	size_t end = tape_skip(src, i), base = tape->count, j, len;
+	const char *text;
+	unsigned char kind;
+	
+	for (j = i; j < end; j++) {
+		kind = TAPE_KIND(src->entries[j]);
+		switch (kind) {
+			case '{':
+			case '[':
+			case '}':
+			case ']':
+				tape_push(tape, kind, TAPE_VALUE(src->entries[j]) - i + base);
+				break;
+			case 'k':
+			case '"':
+			case '0':
+				text = json_tape_text(src, j, &len);
+				tape_text(tape, kind, text, len);
+				break;
+			default:
+				tape_push(tape, kind, TAPE_VALUE(src->entries[j]));
+		}
+	}
+}
+
+/*
+ * Lay @node out on a new tape, as json_tape_decode would its text.  The
+ * tree, which must hold no lazy strings, is walked the way emit_value
+ * walks it, without recursing.  Objects and arrays still on a tape are
+ * copied from it as they are; those still held as text are decoded.
+ */
+JsonTape *json_tape_from_node(const JsonNode *node)
 {
-	if (node != NULL) {
-		json_remove_from_parent(node);
+	JsonTape *tape = tape_new();
+	const JsonNode *at = node;
+	size_t open = 0;
+	
+	for (;;) {
+		assert(tag_is_valid(at->tag));
+		if (at != node && at->parent->tag == JSON_OBJECT)
+			tape_put_key(tape, at->key);
 		
-		switch (node->tag) {
-			case JSON_STRING:
-				free(node->string_);
+		if (at->on_tape) {
+			tape_copy(tape, at->tape_.tape, at->tape_.index);
+		} else if (at->tag == JSON_ARRAY || at->tag == JSON_OBJECT) {
+			if (at->raw)
+				build_children(at);
+			open = tape_push(tape, at->tag == JSON_ARRAY ? '[' : '{', open);
+			if (at->children.head != NULL) {
+				at = at->children.head;
+				continue;
+			}
+			tape_close(tape, &open);
+		} else {
+			tape_put_scalar(tape, at);
+		}
+		
+		while (at != node && at->next == NULL) {
+			at = at->parent;
+			tape_close(tape, &open);
+		}
+		if (at == node)
+			return tape;
+		at = at->next;
+	}
+}
+
+/* Write value @i the way emit_value writes its tree. */
+static void emit_tape(SB *out, const JsonTape *tape, size_t i, Indent *in, int indent_level)
+{
+	size_t end = tape_skip(tape, i), start = i;
+	unsigned char kind, prev = 0;
+	int depth = indent_level;
+	
+	for (; i < end; prev = kind, i++) {
+		kind = TAPE_KIND(tape->entries[i]);
+		
+		if (kind == '}' || kind == ']') {
+			depth--;
+			if (in->space != NULL && prev != '{' && prev != '[')
+				emit_newline(out, in, depth);
+			sb_putc(out, kind);
+			continue;
+		}
+		if (prev == '{' || prev == '[') {
+			if (in->space != NULL)
+				emit_newline(out, in, depth);
+		} else if (!TAPE_IS_KEY(prev) && i != start) {
+			sb_putc(out, ',');
+			if (in->space != NULL)
+				emit_newline(out, in, depth);
+		}
+		
+		switch (kind) {
+			case '{':
+			case '[':
+				sb_putc(out, kind);
+				depth++;
 				break;
-			case JSON_ARRAY:
-			case JSON_OBJECT:
-			{
-				JsonNode *child, *next;
-				for (child = node->children.head; child != NULL; child = next) {
-					next = child->next;
-					json_delete(child);
-				}
+			case 'k':
+				emit_string(out, json_tape_text(tape, i, NULL), true);
+				sb_puts(out, in->space != NULL ? ": " : ":");
+				break;
+			case 'K': {
+				const InternedKey *ik = key_table.keys[TAPE_VALUE(tape->entries[i])];
+				
+				sb_put(out, ik->escaped, ik->escaped_len);
+				if (in->space != NULL)
+					sb_putc(out, ' ');
 				break;
 			}
-			default:;
+			case '"':
+				emit_string(out, json_tape_text(tape, i, NULL), true);
+				break;
+			case '0': {
+				size_t len;
+				const char *text = json_tape_text(tape, i, &len);
+				sb_put(out, text, len);
+				break;
+			}
+			case 't':
+				sb_puts(out, "true");
+				break;
+			case 'f':
+				sb_puts(out, "false");
+				break;
+			default:
+				sb_puts(out, "null");
 		}
+	}
+}
+
+char *json_tape_stringify(const JsonTape *tape, size_t i, const char *space)
+{
+	SB sb;
+	Indent in;
+	sb_init(&sb);
+	
+	indent_init(&in, space);
+	emit_tape(&sb, tape, i, &in, 0);
+	indent_free(&in);
+	
+	return sb_finish(&sb);
+}
+
+bool json_tape_write(FILE *fp, const JsonTape *tape, size_t i, const char *space)
+{
+	SB sb;
+	Indent in;
+	bool ok;
+	
+	sb_init_stream(&sb, fp);
+	
+	indent_init(&in, space);
+	emit_tape(&sb, tape, i, &in, 0);
+	indent_free(&in);
+	
+	sb_flush(&sb);
+	ok = !sb.failed;
+	sb_free(&sb);
+	return ok;
+}
+
+JsonNode *json_find_element(JsonNode *array, int index)
+{
+	JsonNode *element;
+	int i = 0;
+	
+	if (array == NULL || array->tag != JSON_ARRAY)
+		return NULL;
+	
+	json_foreach(element, array) {
+		if (i == index)
+			return element;
+		i++;
+	}
+	
+	return NULL;
+}
+
+JsonNode *json_find_member(JsonNode *object, const char *name)
+{
+	if (object == NULL || object->tag != JSON_OBJECT)
+		return NULL;
+	if (children_pending(object))
+		build_children(object);
+	
+	return lookup_member(object, name);
+}
+
+JsonNode *json_first_child(const JsonNode *node)
+{
+	if (node != NULL && (node->tag == JSON_ARRAY || node->tag == JSON_OBJECT)) {
+		if (children_pending(node))
+			build_children(node);
+		return node->children.head;
+	}
+	return NULL;
+}
+
+/*
+ * Member index
+ *
+ * Once a lookup has had to walk INDEX_THRESHOLD members of an object,
+ * the object gets an open-addressing hash table mapping each key to the
+ * first member that carries it.  The children list still defines member
+ * order; the table is kept up to date by the node linking functions.
+ */
+
+#define INDEX_THRESHOLD	16
+#define INDEX_TOMBSTONE	((JsonNode *) &index_tombstone)
+
+static const char index_tombstone;
+
+typedef struct JsonIndex JsonIndex;
+
+typedef struct
+{
+	size_t hash;
+	JsonNode *node; /* NULL if empty, INDEX_TOMBSTONE if deleted */
+} IndexSlot;
+
+struct JsonIndex
+{
+	size_t mask;     /* number of slots - 1 */
+	size_t used;     /* live and deleted slots */
+	bool dups;       /* some key is carried by more than one member */
+	bool heap;       /* malloc'd, rather than taken from an arena */
+	IndexSlot slots[];
+};
+
+/* FNV-1a */
+static size_t key_hash(const char *key)
+{
+	size_t hash = (size_t) 2166136261u;
+	
+	while (*key != 0)
+		hash = (hash ^ (unsigned char)*key++) * 16777619u;
+	return hash;
+}
+
+static JsonIndex *index_new(const JsonNode *object, size_t size)
+{
+	size_t bytes = sizeof(JsonIndex) + size * sizeof(IndexSlot);
+	JsonIndex *index;
+	bool heap = object->arena == NULL;
+	
+	if (heap) {
+		index = (JsonIndex*) malloc(bytes);
+		if (index == NULL)
+			out_of_memory();
+	} else {
+		index = (JsonIndex*) arena_alloc(object->arena, bytes);
+	}
+	memset(index, 0, bytes);
+	index->mask = size - 1;
+	index->heap = heap;
+	return index;
+}
+
+static void index_free(JsonNode *object)
+{
+	JsonIndex *index = object->children.index;
+	
+	if (index != NULL && index->heap)
+		free(index);
+	object->children.index = NULL;
+}
+
+/* Find the slot holding @key, or the empty slot where it would go. */
+static IndexSlot *index_slot(JsonIndex *index, const char *key, size_t hash)
+{
+	IndexSlot *tombstone = NULL;
+	size_t i;
+	
+	for (i = hash & index->mask;; i = (i + 1) & index->mask) {
+		IndexSlot *slot = &index->slots[i];
 		
-		free(node);
+		if (slot->node == NULL)
+			return tombstone != NULL ? tombstone : slot;
+		if (slot->node == INDEX_TOMBSTONE) {
+			if (tombstone == NULL)
+				tombstone = slot;
+		} else if (slot->hash == hash && strcmp(slot->node->key, key) == 0) {
+			return slot;
+		}
 	}
 }
 
-bool json_validate(const char *json)
+/*
+ * Record @member in the index of @object.  @first says whether the
+ * member precedes any other member with the same key.
+ */
+static void index_add(JsonNode *object, JsonNode *member, bool first);
+
+static void index_build(JsonNode *object)
+{
+	JsonNode *member;
+	size_t count = 0, size = 32;
+	
+	for (member = object->children.head; member != NULL; member = member->next)
+		count++;
+	while (size < count * 2)
+		size *= 2;
+	object->children.index = index_new(object, size);
+	for (member = object->children.head; member != NULL; member = member->next)
+		index_add(object, member, false);
+}
+
+static void index_add(JsonNode *object, JsonNode *member, bool first)
 {
-	const char *s = json;
+	JsonIndex *index = object->children.index;
+	size_t hash = key_hash(member->key);
+	IndexSlot *slot = index_slot(index, member->key, hash);
 	
-	skip_space(&s);
-	if (!parse_value(&s, NULL))
-		return false;
+	if (slot->node != NULL && slot->node != INDEX_TOMBSTONE) {
+		index->dups = true;
+		if (first)
+			slot->node = member;
+		return;
+	}
 	
-	skip_space(&s);
-	if (*s != 0)
-		return false;
+	if (slot->node == NULL)
+		index->used++;
+	slot->hash = hash;
+	slot->node = member;
 	
-	return true;
+	if (index->used * 4 > (index->mask + 1) * 3) {
+		/* Too full: rebuild at twice the size, dropping tombstones. */
+		JsonIndex *old = index;
+		size_t i;
+		
+		object->children.index = index_new(object, (old->mask + 1) * 2);
+		object->children.index->dups = old->dups;
+		for (i = 0; i <= old->mask; i++) {
+			IndexSlot *o = &old->slots[i];
+			if (o->node != NULL && o->node != INDEX_TOMBSTONE) {
+				slot = index_slot(object->children.index, o->node->key, o->hash);
+				*slot = *o;
+				object->children.index->used++;
+			}
+		}
+		if (old->heap)
+			free(old);
+	}
 }
 
-JsonNode *json_find_element(JsonNode *array, int index)
+/* Forget @member, which is still linked into @object. */
+static void index_remove(JsonNode *object, JsonNode *member)
 {
-	JsonNode *element;
-	int i = 0;
+	JsonIndex *index = object->children.index;
+	IndexSlot *slot = index_slot(index, member->key, key_hash(member->key));
+	JsonNode *next;
 	
-	if (array == NULL || array->tag != JSON_ARRAY)
-		return NULL;
+	if (slot->node != member)
+		return; /* a later duplicate, or not indexed */
 	
-	json_foreach(element, array) {
-		if (i == index)
-			return element;
-		i++;
+	if (index->dups) {
+		for (next = member->next; next != NULL; next = next->next) {
+			if (strcmp(next->key, member->key) == 0) {
+				slot->node = next;
+				return;
+			}
+		}
 	}
-	
-	return NULL;
+	slot->node = INDEX_TOMBSTONE;
 }
 
-JsonNode *json_find_member(JsonNode *object, const char *name)
+static JsonNode *lookup_member(JsonNode *object, const char *key)
 {
 	JsonNode *member;
+	size_t count = 0;
 	
-	if (object == NULL || object->tag != JSON_OBJECT)
-		return NULL;
+	if (object->children.index != NULL) {
+		IndexSlot *slot = index_slot(object->children.index, key, key_hash(key));
+		return slot->node == INDEX_TOMBSTONE ? NULL : slot->node;
+	}
 	
-	json_foreach(member, object)
-		if (strcmp(member->key, name) == 0)
-			return member;
+	for (member = object->children.head; member != NULL; member = member->next, count++)
+		if (strcmp(member->key, key) == 0)
+			break;
 	
-	return NULL;
-}
-
-JsonNode *json_first_child(const JsonNode *node)
-{
-	if (node != NULL && (node->tag == JSON_ARRAY || node->tag == JSON_OBJECT))
-		return node->children.head;
-	return NULL;
+	if (count >= INDEX_THRESHOLD)
+		index_build(object);
+	return member;
 }
 
 static JsonNode *mknode(JsonTag tag)
 {
-	JsonNode *ret = (JsonNode*) calloc(1, sizeof(JsonNode));
-	if (ret == NULL)
-		out_of_memory();
+	JsonNode *ret;
+	
+	if (current_arena != NULL) {
+		ret = (JsonNode*) arena_alloc(current_arena, sizeof(JsonNode));
+		memset(ret, 0, sizeof(JsonNode));
+		ret->arena = current_arena;
+	} else {
+		ret = (JsonNode*) calloc(1, sizeof(JsonNode));
+		if (ret == NULL)
+			out_of_memory();
+	}
 	ret->tag = tag;
 	return ret;
 }
@@ -538,12 +2932,48 @@ static JsonNode *mkstring(char *s)
 {
 	JsonNode *ret = mknode(JSON_STRING);
 	ret->string_ = s;
+	ret->validated = 1;
 	return ret;
 }
 
 JsonNode *json_mkstring(const char *s)
 {
-	return mkstring(json_strdup(s));
+	JsonNode *ret = mknode(JSON_STRING);
+	ret->string_ = node_strdup(ret, s);
+	ret->validated = 1;
+	return ret;
+}
+
+/*
+ * Like json_mkstring, but without copying: the node refers to `s',
+ * which the caller must keep unchanged until the node is deleted.
+ * (Unless `s' isn't valid UTF-8, in which case a mended copy is made.)
+ */
+JsonNode *json_mkstring_ref(const char *s)
+{
+	JsonNode *ret;
+	
+	if (!utf8_validate(s))
+		return json_mkstring(s);
+	
+	ret = mknode(JSON_STRING);
+	ret->string_ = (char*) s;
+	ret->borrowed = 1;
+	ret->validated = 1;
+	return ret;
+}
+
+/*
+ * A string whose contents are only produced, by `read', when it is
+ * written out, so that they never have to be held in memory at once.
+ */
+JsonNode *json_mkstring_lazy(JsonReader read, void *ctx)
+{
+	JsonNode *ret = mknode(JSON_STRING);
+	ret->lazy_.read = read;
+	ret->lazy_.ctx = ctx;
+	ret->lazy = 1;
+	return ret;
 }
 
 JsonNode *json_mknumber(double n)
@@ -553,6 +2983,26 @@ JsonNode *json_mknumber(double n)
 	return node;
 }
 
+/*
+ * A number that keeps the text it was written with, which must pass
+ * json_validate_number.  It is written out exactly like that, and only
+ * converted to a double if json_number asks for it.
+ */
+JsonNode *json_mknumber_text(const char *num)
+{
+	JsonNode *node = mknode(JSON_NUMBER);
+	assert(json_validate_number(num));
+	node->number_text_ = node_strndup(node, num, strlen(num));
+	return node;
+}
+
+double json_number(const JsonNode *node)
+{
+	if (node->number_text_ != NULL)
+		return strtod(node->number_text_, NULL);
+	return node->number_;
+}
+
 JsonNode *json_mkarray(void)
 {
 	return mknode(JSON_ARRAY);
@@ -575,6 +3025,9 @@ static void append_node(JsonNode *parent, JsonNode *child)
 	else
 		parent->children.head = child;
 	parent->children.tail = child;
+	
+	if (parent->children.index != NULL)
+		index_add(parent, child, false);
 }
 
 static void prepend_node(JsonNode *parent, JsonNode *child)
@@ -589,31 +3042,31 @@ static void prepend_node(JsonNode *parent, JsonNode *child)
 	else
 		parent->children.tail = child;
 	parent->children.head = child;
+	
+	if (parent->children.index != NULL)
+		index_add(parent, child, true);
 }
 
 static void insert_node(JsonNode *parent, JsonNode *child)
 {
 	if (!child) return;
-	JsonNode *this = parent->children.head;
-
-	while (this != NULL && strcmp(this->key, child->key))
-		this = this->next;
+	JsonNode *this = lookup_member(parent, child->key);
 
 	if (this != NULL)
 	{
-		/* we found a matching key, insert before this node */
-		if (this->prev == NULL)
-		{
-			prepend_node(parent, child);
-		}
+		/* we found a matching key, link child in right after it ... */
+		child->parent = parent;
+		child->prev = this;
+		child->next = this->next;
+		if (this->next != NULL)
+			this->next->prev = child;
 		else
-		{
-			child->parent = parent;
-			child->next = this->next;
-			child->prev = this->prev;
-			this->prev->next = child;
-			this->prev = child;
-		}
+			parent->children.tail = child;
+		this->next = child;
+
+		/* ... and let child take its place */
+		if (parent->children.index != NULL)
+			index_slot(parent->children.index, child->key, key_hash(child->key))->node = child;
 		json_delete(this);
 	}
 	else
@@ -624,6 +3077,7 @@ static void append_member(JsonNode *object, char *key, JsonNode *value)
 {
 	if (!value) return;
 	value->key = key;
+	value->validated = 1;
 	append_member_node_fn(object, value);
 }
 
@@ -638,6 +3092,8 @@ void json_append_element(JsonNode *array, JsonNode *element)
 		json_encode(array)
 	);
 	assert(element->parent == NULL);
+	if (children_pending(array))
+		build_children(array);
 	
 	append_node(array, element);
 }
@@ -653,6 +3109,8 @@ void json_prepend_element(JsonNode *array, JsonNode *element)
 		json_encode(array)
 	);
 	assert(element->parent == NULL);
+	if (children_pending(array))
+		build_children(array);
 	
 	prepend_node(array, element);
 }
@@ -669,8 +3127,11 @@ void json_append_member(JsonNode *object, const char *key, JsonNode *value)
 		json_encode(object)
 	);
 	assert(value->parent == NULL);
+	if (children_pending(object))
+		build_children(object);
 	
-	append_member(object, json_strdup(key), value);
+	member_key(value, key);
+	append_member_node_fn(object, value);
 }
 
 void json_prepend_member(JsonNode *object, const char *key, JsonNode *value)
@@ -685,8 +3146,10 @@ void json_prepend_member(JsonNode *object, const char *key, JsonNode *value)
 		json_encode(object)
 	);
 	assert(value->parent == NULL);
+	if (children_pending(object))
+		build_children(object);
 	
-	value->key = json_strdup(key);
+	member_key(value, key);
 	prepend_node(object, value);
 }
 
@@ -695,311 +3158,423 @@ void json_dedup_members(bool b)
 	append_member_node_fn = b ? insert_node : append_node;
 }
 
-void json_remove_from_parent(JsonNode *node)
+/* Take @node out of its parent's children, leaving it its key. */
+static void unlink_node(JsonNode *node)
 {
 	JsonNode *parent = node->parent;
 	
-	if (parent != NULL) {
-		if (node->prev != NULL)
-			node->prev->next = node->next;
-		else
-			parent->children.head = node->next;
-		if (node->next != NULL)
-			node->next->prev = node->prev;
-		else
-			parent->children.tail = node->prev;
-		
-		free(node->key);
+	if (parent->children.index != NULL)
+		index_remove(parent, node);
+	if (node->prev != NULL)
+		node->prev->next = node->next;
+	else
+		parent->children.head = node->next;
+	if (node->next != NULL)
+		node->next->prev = node->prev;
+	else
+		parent->children.tail = node->prev;
+	
+	node->parent = NULL;
+	node->prev = node->next = NULL;
+}
+
+void json_remove_from_parent(JsonNode *node)
+{
+	if (node->parent != NULL) {
+		unlink_node(node);
+		clear_key(node);
+	}
+}
+
+/*
+ * Merging
+ *
+ * json_merge_patch applies a JSON merge patch (RFC 7396).  Members are
+ * moved from the patch into the target, keys and all, rather than
+ * copied, and each is looked up with lookup_member, so that large
+ * objects get an index: a merge takes time in proportion to the size of
+ * the patch.
+ */
+
+/* Delete the null members of @object and of the objects in it. */
+static void drop_nulls(JsonNode *object)
+{
+	JsonNode *member, *next;
+	
+	if (children_pending(object))
+		build_children(object);
+	for (member = object->children.head; member != NULL; member = next) {
+		next = member->next;
+		if (member->tag == JSON_NULL)
+			json_delete(member);
+		else if (member->tag == JSON_OBJECT)
+			drop_nulls(member);
+	}
+}
+
+/* Merge the members of object @patch into object @target. */
+static void merge_members(JsonNode *target, JsonNode *patch)
+{
+	JsonNode *member, *next, *old;
+	
+	if (children_pending(target))
+		build_children(target);
+	if (children_pending(patch))
+		build_children(patch);
+	
+	for (member = patch->children.head; member != NULL; member = next) {
+		next = member->next;
+		old = lookup_member(target, member->key);
 		
-		node->parent = NULL;
-		node->prev = node->next = NULL;
-		node->key = NULL;
+		if (member->tag == JSON_NULL) {
+			json_delete(old);
+		} else if (member->tag == JSON_OBJECT && old != NULL && old->tag == JSON_OBJECT) {
+			merge_members(old, member);
+		} else {
+			if (member->tag == JSON_OBJECT)
+				drop_nulls(member);
+			unlink_node(member);
+			/* Take the place of the member it replaces, if any */
+			insert_node(target, member);
+		}
+	}
+}
+
+JsonNode *json_merge_patch(JsonNode *target, JsonNode *patch)
+{
+	assert(patch->parent == NULL && (target == NULL || target->parent == NULL));
+	
+	if (patch->tag != JSON_OBJECT) {
+		json_delete(target);
+		return patch;
+	}
+	if (target == NULL || target->tag != JSON_OBJECT) {
+		json_delete(target);
+		target = json_mkobject();
 	}
+	merge_members(target, patch);
+	json_delete(patch);
+	return target;
 }
 
+/*
+ * Parse the value at *sp.  This does not recurse: an array or object is
+ * linked into the tree as soon as it opens, so the parent links lead
+ * from the innermost open one back out, and that is all the state there
+ * is.  Input nested more deeply than max_depth is rejected.
+ */
 static bool parse_value(const char **sp, JsonNode **out)
 {
 	const char *s = *sp;
+	JsonNode *root = NULL, *open = NULL, *value;
+	char *key = NULL;
+	bool interned = false;
+	size_t depth = 0;
 	
-	switch (*s) {
-		case 'n':
-			if (expect_literal(&s, "null")) {
-				if (out)
-					*out = json_mknull();
-				*sp = s;
-				return true;
-			}
-			return false;
-		
-		case 'f':
-			if (expect_literal(&s, "false")) {
-				if (out)
-					*out = json_mkbool(false);
-				*sp = s;
-				return true;
-			}
-			return false;
-		
-		case 't':
-			if (expect_literal(&s, "true")) {
-				if (out)
-					*out = json_mkbool(true);
-				*sp = s;
-				return true;
+	for (;;) {
+		/* A value is due at s */
+		switch (*s) {
+			case 'n':
+				if (!expect_literal(&s, "null"))
+					goto failure;
+				value = json_mknull();
+				break;
+			
+			case 'f':
+				if (!expect_literal(&s, "false"))
+					goto failure;
+				value = json_mkbool(false);
+				break;
+			
+			case 't':
+				if (!expect_literal(&s, "true"))
+					goto failure;
+				value = json_mkbool(true);
+				break;
+			
+			case '"': {
+				char *str;
+				if (!parse_string(&s, &str))
+					goto failure;
+				value = mkstring(str);
+				break;
 			}
-			return false;
-		
-		case '"': {
-			char *str;
-			if (parse_string(&s, out ? &str : NULL)) {
-				if (out)
-					*out = mkstring(str);
-				*sp = s;
-				return true;
+			
+			case '[':
+			case '{':
+				if (max_depth != 0 && depth == max_depth)
+					goto failure;
+				depth++;
+				value = *s++ == '[' ? json_mkarray() : json_mkobject();
+				break;
+			
+			default: {
+				const char *start = s;
+				if (!parse_number(&s, NULL))
+					goto failure;
+				/* Keep the number as written */
+				value = mknode(JSON_NUMBER);
+				value->number_text_ = node_strndup(value, start, s - start);
 			}
-			return false;
 		}
 		
-		case '[':
-			if (parse_array(&s, out)) {
-				*sp = s;
-				return true;
-			}
-			return false;
+		if (open == NULL) {
+			root = value;
+		} else if (open->tag == JSON_ARRAY) {
+			append_node(open, value);
+		} else {
+			value->key_interned = interned;
+			append_member(open, key, value);
+			key = NULL;
+		}
 		
-		case '{':
-			if (parse_object(&s, out)) {
-				*sp = s;
-				return true;
+		if ((value->tag == JSON_ARRAY || value->tag == JSON_OBJECT) && value->children.head == NULL) {
+			open = value;
+			skip_space(&s);
+			if (*s != (open->tag == JSON_ARRAY ? ']' : '}')) {
+				if (open->tag == JSON_OBJECT)
+					goto key;
+				continue;
 			}
-			return false;
+		}
 		
-		default: {
-			double num;
-			if (parse_number(&s, out ? &num : NULL)) {
-				if (out)
-					*out = json_mknumber(num);
+		/* After a value: a comma, or the end of the innermost open value */
+		for (;;) {
+			if (open == NULL) {
 				*sp = s;
+				*out = root;
 				return true;
 			}
-			return false;
+			skip_space(&s);
+			if (*s != (open->tag == JSON_ARRAY ? ']' : '}'))
+				break;
+			s++;
+			depth--;
+			open = open->parent;
 		}
+		if (*s++ != ',')
+			goto failure;
+		skip_space(&s);
+		if (open->tag == JSON_ARRAY)
+			continue;
+		
+	key:
+		if (!parse_key(&s, &key, &interned))
+			goto failure;
+		skip_space(&s);
+		if (*s++ != ':')
+			goto failure;
+		skip_space(&s);
 	}
+
+failure:
+	if (key != NULL && !interned && current_arena == NULL)
+		free(key);
+	json_delete(root);
+	return false;
 }
 
-static bool parse_array(const char **sp, JsonNode **out)
+/*
+ * Check that s[0..n), which holds no quote or backslash, can be copied
+ * into a string as it is: no control characters, and valid UTF-8.
+ */
+static bool plain_text(const char *s, size_t n)
 {
-	const char *s = *sp;
-	JsonNode *ret = out ? json_mkarray() : NULL;
-	JsonNode *element;
-	
-	if (*s++ != '[')
-		goto failure;
-	skip_space(&s);
+	size_t ascii = plain_run(s, n, 0x7F);
 	
-	if (*s == ']') {
-		s++;
-		goto success;
+	if (ascii == n)
+		return true;
+	s += ascii;
+	n -= ascii;
+	return plain_run(s, n, 0xFF) == n && utf8_valid_prefix(s, n) == n;
+}
+
+/*
+ * A string is decoded in two passes.  The first (string_close) finds the
+ * closing quote, hopping from one backslash to the next, and so gives an
+ * upper bound on the decoded length (an escape is never shorter than
+ * what it stands for).  The output is allocated once at that size, and
+ * the second pass (string_decode) copies the runs between escapes into
+ * it in bulk, after checking each run for control characters and invalid
+ * UTF-8.
+ */
+
+/* The quote closing the string whose contents start at @s, or NULL */
+static const char *string_close(const char *s)
+{
+	for (;;) {
+		s += strcspn(s, "\\\"");
+		if (*s == '"')
+			return s;
+		if (*s == 0 || s[1] == 0)
+			return NULL; /* unterminated */
+		s += 2;
 	}
+}
+
+/*
+ * Decode the contents s[0..close) of a string into @b (or just check
+ * them, if @b is NULL), setting *end to the end of what was written.
+ */
+static bool string_decode(const char *s, const char *close, char *b, char **end)
+{
+	char throwaway_buffer[4];
+		/* enough space for a UTF-8 character */
 	
-	for (;;) {
-		if (!parse_value(&s, out ? &element : NULL))
-			goto failure;
-		skip_space(&s);
+	while (s < close) {
+		const char *escape = (const char*) memchr(s, '\\', close - s);
+		size_t run = (escape != NULL ? escape : close) - s;
 		
-		if (out)
-			json_append_element(ret, element);
+		if (!plain_text(s, run))
+			return false;
+		if (b) {
+			memcpy(b, s, run);
+			b += run;
+		}
+		s += run;
 		
-		if (*s == ']') {
+		if (s < close) {
+			int len;
+			
 			s++;
-			goto success;
+			len = parse_escape(&s, b ? b : throwaway_buffer);
+			if (len == 0)
+				return false;
+			if (b)
+				b += len;
 		}
-		
-		if (*s++ != ',')
-			goto failure;
-		skip_space(&s);
 	}
-	
-success:
-	*sp = s;
-	if (out)
-		*out = ret;
+	*end = b;
 	return true;
-
-failure:
-	json_delete(ret);
-	return false;
 }
 
-static bool parse_object(const char **sp, JsonNode **out)
+bool parse_string(const char **sp, char **out)
 {
 	const char *s = *sp;
-	JsonNode *ret = out ? json_mkobject() : NULL;
-	char *key;
-	JsonNode *value;
+	const char *close;
+	char *ret = NULL;
+	char *end;
 	
-	if (*s++ != '{')
-		goto failure;
-	skip_space(&s);
+	if (*s++ != '"' || (close = string_close(s)) == NULL)
+		return false;
 	
-	if (*s == '}') {
-		s++;
-		goto success;
+	if (out) {
+		if (current_arena != NULL) {
+			ret = (char*) arena_alloc(current_arena, close - s + 1);
+		} else {
+			ret = (char*) malloc(close - s + 1);
+			if (ret == NULL)
+				out_of_memory();
+		}
 	}
 	
-	for (;;) {
-		if (!parse_string(&s, out ? &key : NULL))
-			goto failure;
-		skip_space(&s);
-		
-		if (*s++ != ':')
-			goto failure_free_key;
-		skip_space(&s);
-		
-		if (!parse_value(&s, out ? &value : NULL))
-			goto failure_free_key;
-		skip_space(&s);
-		
-		if (out)
-			append_member(ret, key, value);
-		
-		if (*s == '}') {
-			s++;
-			goto success;
-		}
-		
-		if (*s++ != ',')
-			goto failure;
-		skip_space(&s);
+	if (!string_decode(s, close, ret, &end)) {
+		/* Arena space is given back when the arena is reset */
+		if (current_arena == NULL)
+			free(ret);
+		return false;
 	}
 	
-success:
-	*sp = s;
-	if (out)
+	if (out) {
+		*end = 0;
 		*out = ret;
+	}
+	*sp = close + 1;
 	return true;
-
-failure_free_key:
-	if (out)
-		free(key);
-failure:
-	json_delete(ret);
-	return false;
 }
 
-bool parse_string(const char **sp, char **out)
+/*
+ * Like parse_string, for a member key: short keys are decoded on the
+ * stack and interned (*interned is set), so no memory is allocated
+ * for a key seen before.
+ */
+static bool parse_key(const char **sp, char **out, bool *interned)
 {
-	const char *s = *sp;
-	SB sb;
-	char throwaway_buffer[4];
-		/* enough space for a UTF-8 character */
-	char *b;
+	const char *s = *sp + 1;
+	const char *close;
+	char buf[KEY_INTERN_MAX_LEN];
+	char *end;
+	long id;
 	
-	if (*s++ != '"')
+	*interned = false;
+	if (out == NULL || **sp != '"' || (close = string_close(s)) == NULL ||
+	    close - s > KEY_INTERN_MAX_LEN)
+		return parse_string(sp, out);
+	
+	if (!string_decode(s, close, buf, &end))
 		return false;
+	if ((id = intern_key(buf, end - buf)) < 0)
+		return parse_string(sp, out);
 	
-	if (out) {
-		sb_init(&sb);
-		sb_need(&sb, 4);
-		b = sb.cur;
-	} else {
-		b = throwaway_buffer;
-	}
+	*out = key_table.keys[id]->text;
+	*interned = true;
+	*sp = close + 1;
+	return true;
+}
+
+/*
+ * Decode the escape sequence after a backslash at *sp, writing the
+ * character to @out (up to 4 bytes).  Return how many bytes were
+ * written, or 0 if the escape is invalid.
+ */
+static int parse_escape(const char **sp, char *out)
+{
+	const char *s = *sp;
+	char *b = out;
+	unsigned char c = *s++;
 	
-	while (*s != '"') {
-		unsigned char c = *s++;
-		
-		/* Parse next character, and write it to b. */
-		if (c == '\\') {
-			c = *s++;
-			switch (c) {
-				case '"':
-				case '\\':
-				case '/':
-					*b++ = c;
-					break;
-				case 'b':
-					*b++ = '\b';
-					break;
-				case 'f':
-					*b++ = '\f';
-					break;
-				case 'n':
-					*b++ = '\n';
-					break;
-				case 'r':
-					*b++ = '\r';
-					break;
-				case 't':
-					*b++ = '\t';
-					break;
-				case 'u':
-				{
-					uint16_t uc, lc;
-					js_uchar_t unicode;
-					
-					if (!parse_hex16(&s, &uc))
-						goto failed;
-					
-					if (uc >= 0xD800 && uc <= 0xDFFF) {
-						/* Handle UTF-16 surrogate pair. */
-						if (*s++ != '\\' || *s++ != 'u' || !parse_hex16(&s, &lc))
-							goto failed; /* Incomplete surrogate pair. */
-						if (!from_surrogate_pair(uc, lc, &unicode))
-							goto failed; /* Invalid surrogate pair. */
-					} else if (uc == 0) {
-						/* Disallow "\u0000". */
-						goto failed;
-					} else {
-						unicode = uc;
-					}
-					
-					b += utf8_write_char(unicode, b);
-					break;
-				}
-				default:
-					/* Invalid escape */
-					goto failed;
-			}
-		} else if (c <= 0x1F) {
-			/* Control characters are not allowed in string literals. */
-			goto failed;
-		} else {
-			/* Validate and echo a UTF-8 character. */
-			int len;
+	switch (c) {
+		case '"':
+		case '\\':
+		case '/':
+			*b++ = c;
+			break;
+		case 'b':
+			*b++ = '\b';
+			break;
+		case 'f':
+			*b++ = '\f';
+			break;
+		case 'n':
+			*b++ = '\n';
+			break;
+		case 'r':
+			*b++ = '\r';
+			break;
+		case 't':
+			*b++ = '\t';
+			break;
+		case 'u':
+		{
+			uint16_t uc, lc;
+			js_uchar_t unicode;
 			
-			s--;
-			len = utf8_validate_cz(s);
-			if (len == 0)
-				goto failed; /* Invalid UTF-8 character. */
+			if (!parse_hex16(&s, &uc))
+				return 0;
 			
-			while (len--)
-				*b++ = *s++;
-		}
-		
-		/*
-		 * Update sb to know about the new bytes,
-		 * and set up b to write another character.
-		 */
-		if (out) {
-			sb.cur = b;
-			sb_need(&sb, 4);
-			b = sb.cur;
-		} else {
-			b = throwaway_buffer;
+			if (uc >= 0xD800 && uc <= 0xDFFF) {
+				/* Handle UTF-16 surrogate pair. */
+				if (*s++ != '\\' || *s++ != 'u' || !parse_hex16(&s, &lc))
+					return 0; /* Incomplete surrogate pair. */
+				if (!from_surrogate_pair(uc, lc, &unicode))
+					return 0; /* Invalid surrogate pair. */
+			} else if (uc == 0) {
+				/* Disallow "\u0000". */
+				return 0;
+			} else {
+				unicode = uc;
+			}
+			
+			b += utf8_write_char(unicode, b);
+			break;
 		}
+		default:
+			/* Invalid escape */
+			return 0;
 	}
-	s++;
 	
-	if (out)
-		*out = sb_finish(&sb);
 	*sp = s;
-	return true;
-
-failed:
-	if (out)
-		sb_free(&sb);
-	return false;
+	return b - out;
 }
 
 /*
@@ -1068,36 +3643,58 @@ static void skip_space(const char **sp)
 	*sp = s;
 }
 
-static void emit_value(SB *out, const JsonNode *node)
+/*
+ * Write @node, compactly or indented as @in says.  Like json_delete, this
+ * walks the tree rather than recursing into it: an object or array is
+ * opened on the way down to its first child, and closed on the way back
+ * up from its last.
+ */
+static void emit_value(SB *out, const JsonNode *node, Indent *in)
 {
-	assert(tag_is_valid(node->tag));
-	switch (node->tag) {
-		case JSON_NULL:
-			sb_puts(out, "null");
-			break;
-		case JSON_BOOL:
-			sb_puts(out, node->bool_ ? "true" : "false");
-			break;
-		case JSON_STRING:
-			emit_string(out, node->string_);
-			break;
-		case JSON_NUMBER:
-			emit_number(out, node->number_);
-			break;
-		case JSON_ARRAY:
-			emit_array(out, node);
-			break;
-		case JSON_OBJECT:
-			emit_object(out, node);
-			break;
-		default:
-			assert(false);
+	const JsonNode *at = node;
+	int depth = 0;
+	
+	for (;;) {
+		assert(tag_is_valid(at->tag));
+		if (in->space != NULL && at->raw)
+			build_children(at);
+		
+		if ((at->tag == JSON_ARRAY || at->tag == JSON_OBJECT) &&
+		    !children_pending(at) && at->children.head != NULL) {
+			sb_putc(out, at->tag == JSON_ARRAY ? '[' : '{');
+			depth++;
+			at = at->children.head;
+			if (in->space != NULL)
+				emit_newline(out, in, depth);
+			if (at->parent->tag == JSON_OBJECT)
+				emit_key(out, at, in->space);
+			continue;
+		}
+		
+		emit_leaf(out, at, in, depth);
+		
+		while (at != node && at->next == NULL) {
+			at = at->parent;
+			depth--;
+			if (in->space != NULL)
+				emit_newline(out, in, depth);
+			sb_putc(out, at->tag == JSON_ARRAY ? ']' : '}');
+		}
+		if (at == node)
+			return;
+		
+		at = at->next;
+		sb_putc(out, ',');
+		if (in->space != NULL)
+			emit_newline(out, in, depth);
+		if (at->parent->tag == JSON_OBJECT)
+			emit_key(out, at, in->space);
 	}
 }
 
-void emit_value_indented(SB *out, const JsonNode *node, const char *space, int indent_level)
+/* Write a scalar, or an object or array whose children emit_value won't visit. */
+static void emit_leaf(SB *out, const JsonNode *node, Indent *in, int depth)
 {
-	assert(tag_is_valid(node->tag));
 	switch (node->tag) {
 		case JSON_NULL:
 			sb_puts(out, "null");
@@ -1106,107 +3703,45 @@ void emit_value_indented(SB *out, const JsonNode *node, const char *space, int i
 			sb_puts(out, node->bool_ ? "true" : "false");
 			break;
 		case JSON_STRING:
-			emit_string(out, node->string_);
+			if (node->lazy)
+				emit_lazy_string(out, node);
+			else
+				emit_string(out, node->string_, node->validated);
 			break;
 		case JSON_NUMBER:
-			emit_number(out, node->number_);
+			if (node->number_text_ != NULL)
+				sb_puts(out, node->number_text_);
+			else
+				emit_number(out, node->number_);
 			break;
 		case JSON_ARRAY:
-			emit_array_indented(out, node, space, indent_level);
-			break;
 		case JSON_OBJECT:
-			emit_object_indented(out, node, space, indent_level);
+			if (node->raw)
+				emit_raw(out, node);
+			else if (node->on_tape)
+				emit_tape(out, node->tape_.tape, node->tape_.index, in, depth);
+			else
+				sb_puts(out, node->tag == JSON_ARRAY ? "[]" : "{}");
 			break;
 		default:
 			assert(false);
 	}
 }
 
-static void emit_array(SB *out, const JsonNode *array)
-{
-	const JsonNode *element;
-	
-	sb_putc(out, '[');
-	json_foreach(element, array) {
-		emit_value(out, element);
-		if (element->next != NULL)
-			sb_putc(out, ',');
-	}
-	sb_putc(out, ']');
-}
-
-static void emit_array_indented(SB *out, const JsonNode *array, const char *space, int indent_level)
-{
-	const JsonNode *element = array->children.head;
-	int i;
-	
-	if (element == NULL) {
-		sb_puts(out, "[]");
-		return;
-	}
-	
-	sb_puts(out, "[\n");
-	while (element != NULL) {
-		for (i = 0; i < indent_level + 1; i++)
-			sb_puts(out, space);
-		emit_value_indented(out, element, space, indent_level + 1);
-		
-		element = element->next;
-		sb_puts(out, element != NULL ? ",\n" : "\n");
-	}
-	for (i = 0; i < indent_level; i++)
-		sb_puts(out, space);
-	sb_putc(out, ']');
-}
-
-static void emit_object(SB *out, const JsonNode *object)
-{
-	const JsonNode *member;
-	
-	sb_putc(out, '{');
-	json_foreach(member, object) {
-		emit_string(out, member->key);
-		sb_putc(out, ':');
-		emit_value(out, member);
-		if (member->next != NULL)
-			sb_putc(out, ',');
-	}
-	sb_putc(out, '}');
-}
-
-static void emit_object_indented(SB *out, const JsonNode *object, const char *space, int indent_level)
-{
-	const JsonNode *member = object->children.head;
-	int i;
-	
-	if (member == NULL) {
-		sb_puts(out, "{}");
-		return;
-	}
-	
-	sb_puts(out, "{\n");
-	while (member != NULL) {
-		for (i = 0; i < indent_level + 1; i++)
-			sb_puts(out, space);
-		emit_string(out, member->key);
-		sb_puts(out, ": ");
-		emit_value_indented(out, member, space, indent_level + 1);
-		
-		member = member->next;
-		sb_puts(out, member != NULL ? ",\n" : "\n");
-	}
-	for (i = 0; i < indent_level; i++)
-		sb_puts(out, space);
-	sb_putc(out, '}');
-}
-
-void emit_string(SB *out, const char *str)
+/*
+ * Write @str as a JSON string.  If @valid, @str is known to be valid
+ * UTF-8 and runs of non-ASCII characters are copied without looking
+ * at them.
+ */
+void emit_string(SB *out, const char *str, bool valid)
 {
 	bool escape_unicode = false;
 	const char *s = str;
+	const char *end = str + strlen(str);
+	unsigned char last = (valid && !escape_unicode) ? 0xFF : 0x7F;
 	char *b;
 	
-	assert(utf8_validate(str));
+	assert(valid || utf8_validate(str));
 	
 	/*
 	 * 14 bytes is enough space to write up to two
@@ -1216,7 +3751,20 @@ void emit_string(SB *out, const char *str)
 	b = out->cur;
 	
 	*b++ = '"';
-	while (*s != 0) {
+	while (s < end) {
+		size_t run = plain_run(s, end - s, last);
+		
+		/* Copy plain bytes in one go, then encode the one after them */
+		if (run > 0) {
+			out->cur = b;
+			sb_put(out, s, run);
+			s += run;
+			sb_need(out, 14);
+			b = out->cur;
+			if (s == end)
+				break;
+		}
+		
 		unsigned char c = *s++;
 		
 		/* Encode the next character, and write it to b. */
@@ -1323,21 +3871,378 @@ void emit_string(SB *out, const char *str)
 	out->cur = b;
 }
 
+/* Room offered to a JsonReader at a time (at least) */
+#define LAZY_CHUNK_SIZE	4096
+
+/*
+ * Write the text of a raw node (see json_decode_raw) as emit_value would
+ * write its decoded tree: whitespace is dropped, numbers and literals are
+ * copied, and so are strings, unless they contain escapes to normalize.
+ */
+static void emit_raw(SB *out, const JsonNode *node)
+{
+	const char *s = node->raw_.text;
+	const char *end = s + node->raw_.len;
+	
+	while (s < end) {
+		size_t run = strcspn(s, " \t\n\r\"");
+		
+		if (run > 0) {
+			sb_put(out, s, run);
+			s += run;
+		} else if (*s != '"') {
+			s++;
+		} else if (s[1 + (run = strcspn(s + 1, "\"\\"))] == '"') {
+			sb_put(out, s, run + 2);
+			s += run + 2;
+		} else {
+			JsonArena *arena = current_arena;
+			char *str;
+			
+			/* decode onto the heap, so nothing is left in the arena */
+			current_arena = NULL;
+			if (!parse_string(&s, &str))
+				assert(false);	/* validated by decode_raw */
+			current_arena = arena;
+			emit_string(out, str, true);
+			free(str);
+		}
+	}
+}
+
+static void emit_lazy_string(SB *out, const JsonNode *node)
+{
+	long n;
+	
+	sb_putc(out, '"');
+	for (;;) {
+		sb_need(out, LAZY_CHUNK_SIZE);
+		n = node->lazy_.read(node->lazy_.ctx, out->cur, out->end - out->cur);
+		if (n <= 0) {
+			if (n < 0)
+				out->failed = true;
+			break;
+		}
+		out->cur += n;
+	}
+	sb_putc(out, '"');
+}
+
+/*
+ * Number formatting
+ *
+ * Numbers are written with digits that read back as the same double,
+ * usually the fewest, using Florian Loitsch's Grisu2 algorithm ("Printing
+ * Floating-Point Numbers Quickly and Accurately with Integers", PLDI 2010).
+ * For a small share of doubles Grisu2 gives a digit more than needed.
+ * The layout follows printf's %g: an exponent is used only when the
+ * decimal exponent is below -4 or at least 16.  Integers of up to 16
+ * digits, by far the most common numbers, take a shortcut.
+ */
+
+typedef struct {
+	uint64_t f;
+	int e;
+} DiyFp;
+
+#define DIY_SIGNIFICAND_SIZE	64
+#define DBL_SIGNIFICAND_SIZE	52
+#define DBL_EXPONENT_BIAS	(0x3FF + DBL_SIGNIFICAND_SIZE)
+#define DBL_HIDDEN_BIT		(UINT64_C(1) << DBL_SIGNIFICAND_SIZE)
+#define DBL_SIGNIFICAND_MASK	(DBL_HIDDEN_BIT - 1)
+
+static DiyFp diy_from_double(double d)
+{
+	DiyFp r;
+	uint64_t bits;
+	int biased_e;
+	
+	memcpy(&bits, &d, sizeof(bits));
+	biased_e = (int)((bits >> DBL_SIGNIFICAND_SIZE) & 0x7FF);
+	r.f = bits & DBL_SIGNIFICAND_MASK;
+	if (biased_e != 0) {
+		r.f += DBL_HIDDEN_BIT;
+		r.e = biased_e - DBL_EXPONENT_BIAS;
+	} else {
+		r.e = 1 - DBL_EXPONENT_BIAS;
+	}
+	return r;
+}
+
+/* Upper 64 bits of the product, rounded. */
+static DiyFp diy_multiply(DiyFp x, DiyFp y)
+{
+	const uint64_t M32 = 0xFFFFFFFFu;
+	uint64_t a = x.f >> 32, b = x.f & M32, c = y.f >> 32, d = y.f & M32;
+	uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+	uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32) + (UINT64_C(1) << 31);
+	DiyFp r;
+	
+	r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+	r.e = x.e + y.e + 64;
+	return r;
+}
+
+static DiyFp diy_normalize(DiyFp x)
+{
+	while (!(x.f & (UINT64_C(1) << 63))) {
+		x.f <<= 1;
+		x.e--;
+	}
+	return x;
+}
+
+/* The neighbours of @v halfway to the next double down (@mi) and up (@pl). */
+static void diy_boundaries(DiyFp v, DiyFp *mi, DiyFp *pl)
+{
+	pl->f = (v.f << 1) + 1;
+	pl->e = v.e - 1;
+	*pl = diy_normalize(*pl);
+	if (v.f == DBL_HIDDEN_BIT) {
+		mi->f = (v.f << 2) - 1;
+		mi->e = v.e - 2;
+	} else {
+		mi->f = (v.f << 1) - 1;
+		mi->e = v.e - 1;
+	}
+	mi->f <<= mi->e - pl->e;
+	mi->e = pl->e;
+}
+
+/* 10^k for k = -348, -340, ..., 340, normalized */
+static const uint64_t cached_powers_f[] = {
+	UINT64_C(0xfa8fd5a0081c0288), UINT64_C(0xbaaee17fa23ebf76), UINT64_C(0x8b16fb203055ac76),
+	UINT64_C(0xcf42894a5dce35ea), UINT64_C(0x9a6bb0aa55653b2d), UINT64_C(0xe61acf033d1a45df),
+	UINT64_C(0xab70fe17c79ac6ca), UINT64_C(0xff77b1fcbebcdc4f), UINT64_C(0xbe5691ef416bd60c),
+	UINT64_C(0x8dd01fad907ffc3c), UINT64_C(0xd3515c2831559a83), UINT64_C(0x9d71ac8fada6c9b5),
+	UINT64_C(0xea9c227723ee8bcb), UINT64_C(0xaecc49914078536d), UINT64_C(0x823c12795db6ce57),
+	UINT64_C(0xc21094364dfb5637), UINT64_C(0x9096ea6f3848984f), UINT64_C(0xd77485cb25823ac7),
+	UINT64_C(0xa086cfcd97bf97f4), UINT64_C(0xef340a98172aace5), UINT64_C(0xb23867fb2a35b28e),
+	UINT64_C(0x84c8d4dfd2c63f3b), UINT64_C(0xc5dd44271ad3cdba), UINT64_C(0x936b9fcebb25c996),
+	UINT64_C(0xdbac6c247d62a584), UINT64_C(0xa3ab66580d5fdaf6), UINT64_C(0xf3e2f893dec3f126),
+	UINT64_C(0xb5b5ada8aaff80b8), UINT64_C(0x87625f056c7c4a8b), UINT64_C(0xc9bcff6034c13053),
+	UINT64_C(0x964e858c91ba2655), UINT64_C(0xdff9772470297ebd), UINT64_C(0xa6dfbd9fb8e5b88f),
+	UINT64_C(0xf8a95fcf88747d94), UINT64_C(0xb94470938fa89bcf), UINT64_C(0x8a08f0f8bf0f156b),
+	UINT64_C(0xcdb02555653131b6), UINT64_C(0x993fe2c6d07b7fac), UINT64_C(0xe45c10c42a2b3b06),
+	UINT64_C(0xaa242499697392d3), UINT64_C(0xfd87b5f28300ca0e), UINT64_C(0xbce5086492111aeb),
+	UINT64_C(0x8cbccc096f5088cc), UINT64_C(0xd1b71758e219652c), UINT64_C(0x9c40000000000000),
+	UINT64_C(0xe8d4a51000000000), UINT64_C(0xad78ebc5ac620000), UINT64_C(0x813f3978f8940984),
+	UINT64_C(0xc097ce7bc90715b3), UINT64_C(0x8f7e32ce7bea5c70), UINT64_C(0xd5d238a4abe98068),
+	UINT64_C(0x9f4f2726179a2245), UINT64_C(0xed63a231d4c4fb27), UINT64_C(0xb0de65388cc8ada8),
+	UINT64_C(0x83c7088e1aab65db), UINT64_C(0xc45d1df942711d9a), UINT64_C(0x924d692ca61be758),
+	UINT64_C(0xda01ee641a708dea), UINT64_C(0xa26da3999aef774a), UINT64_C(0xf209787bb47d6b85),
+	UINT64_C(0xb454e4a179dd1877), UINT64_C(0x865b86925b9bc5c2), UINT64_C(0xc83553c5c8965d3d),
+	UINT64_C(0x952ab45cfa97a0b3), UINT64_C(0xde469fbd99a05fe3), UINT64_C(0xa59bc234db398c25),
+	UINT64_C(0xf6c69a72a3989f5c), UINT64_C(0xb7dcbf5354e9bece), UINT64_C(0x88fcf317f22241e2),
+	UINT64_C(0xcc20ce9bd35c78a5), UINT64_C(0x98165af37b2153df), UINT64_C(0xe2a0b5dc971f303a),
+	UINT64_C(0xa8d9d1535ce3b396), UINT64_C(0xfb9b7cd9a4a7443c), UINT64_C(0xbb764c4ca7a44410),
+	UINT64_C(0x8bab8eefb6409c1a), UINT64_C(0xd01fef10a657842c), UINT64_C(0x9b10a4e5e9913129),
+	UINT64_C(0xe7109bfba19c0c9d), UINT64_C(0xac2820d9623bf429), UINT64_C(0x80444b5e7aa7cf85),
+	UINT64_C(0xbf21e44003acdd2d), UINT64_C(0x8e679c2f5e44ff8f), UINT64_C(0xd433179d9c8cb841),
+	UINT64_C(0x9e19db92b4e31ba9), UINT64_C(0xeb96bf6ebadf77d9), UINT64_C(0xaf87023b9bf0ee6b)
+};
+
+static const int16_t cached_powers_e[] = {
+	-1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+	-954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+	-688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+	-422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+	-157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+	109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+	375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+	641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+	907, 933, 960, 986, 1013, 1039, 1066
+};
+
+/* A cached power of ten that brings binary exponent @e into range; 10^-@K */
+static DiyFp cached_power(int e, int *K)
+{
+	double dk = (-61 - e) * 0.30102999566398114 + 347;
+	int k = (int) dk;
+	unsigned int index;
+	DiyFp r;
+	
+	if (dk - k > 0.0)
+		k++;
+	index = (unsigned int)((k >> 3) + 1);
+	*K = -(-348 + (int)(index << 3));
+	r.f = cached_powers_f[index];
+	r.e = cached_powers_e[index];
+	return r;
+}
+
+static const uint64_t pow10_u64[] = {
+	UINT64_C(1), UINT64_C(10), UINT64_C(100), UINT64_C(1000), UINT64_C(10000),
+	UINT64_C(100000), UINT64_C(1000000), UINT64_C(10000000), UINT64_C(100000000),
+	UINT64_C(1000000000), UINT64_C(10000000000), UINT64_C(100000000000),
+	UINT64_C(1000000000000), UINT64_C(10000000000000), UINT64_C(100000000000000),
+	UINT64_C(1000000000000000), UINT64_C(10000000000000000),
+	UINT64_C(100000000000000000), UINT64_C(1000000000000000000),
+	UINT64_C(10000000000000000000)
+};
+
+static void grisu_round(char *buf, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w)
+{
+	while (rest < wp_w && delta - rest >= ten_kappa &&
+	       (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+		buf[len - 1]--;
+		rest += ten_kappa;
+	}
+}
+
+static int count_digits(uint32_t n)
+{
+	int d = 1;
+	
+	while (d < 10 && n >= pow10_u64[d])
+		d++;
+	return d;
+}
+
+static int digit_gen(DiyFp W, DiyFp Mp, uint64_t delta, char *buf, int *K)
+{
+	DiyFp one, wp_w;
+	uint32_t p1;
+	uint64_t p2;
+	int kappa, len = 0;
+	
+	one.f = UINT64_C(1) << -Mp.e;
+	one.e = Mp.e;
+	wp_w.f = Mp.f - W.f;
+	p1 = (uint32_t)(Mp.f >> -one.e);
+	p2 = Mp.f & (one.f - 1);
+	kappa = count_digits(p1);
+	
+	while (kappa > 0) {
+		uint32_t d = p1 / (uint32_t) pow10_u64[kappa - 1];
+		uint64_t rest;
+		
+		p1 %= (uint32_t) pow10_u64[kappa - 1];
+		if (d || len)
+			buf[len++] = (char)('0' + d);
+		kappa--;
+		rest = ((uint64_t) p1 << -one.e) + p2;
+		if (rest <= delta) {
+			*K += kappa;
+			grisu_round(buf, len, delta, rest, pow10_u64[kappa] << -one.e, wp_w.f);
+			return len;
+		}
+	}
+	
+	for (;;) {
+		char d;
+		
+		p2 *= 10;
+		delta *= 10;
+		d = (char)(p2 >> -one.e);
+		if (d || len)
+			buf[len++] = (char)('0' + d);
+		p2 &= one.f - 1;
+		kappa--;
+		if (p2 < delta) {
+			*K += kappa;
+			grisu_round(buf, len, delta, p2, one.f,
+				-kappa < 20 ? wp_w.f * pow10_u64[-kappa] : 0);
+			return len;
+		}
+	}
+}
+
+/*
+ * Write digits of positive, finite @num that read back as @num, usually
+ * the fewest, to @buf; @num = digits * 10^@K.  Returns the number of digits.
+ */
+static int grisu2(double num, char *buf, int *K)
+{
+	DiyFp v = diy_from_double(num), mi, pl, c_mk, W, Wp, Wm;
+	
+	diy_boundaries(v, &mi, &pl);
+	c_mk = cached_power(pl.e, K);
+	W = diy_multiply(diy_normalize(v), c_mk);
+	Wp = diy_multiply(pl, c_mk);
+	Wm = diy_multiply(mi, c_mk);
+	Wm.f++;
+	Wp.f--;
+	return digit_gen(W, Wp, Wp.f - Wm.f, buf, K);
+}
+
+/* Write the digits of @n backwards, ending at @end; return the start. */
+static char *write_u64(char *end, uint64_t n)
+{
+	do {
+		*--end = (char)('0' + n % 10);
+		n /= 10;
+	} while (n != 0);
+	return end;
+}
+
 static void emit_number(SB *out, double num)
 {
-	/*
-	 * This isn't exactly how JavaScript renders numbers,
-	 * but it should produce valid JSON for reasonable numbers
-	 * preserve precision well enough, and avoid some oddities
-	 * like 0.3 -> 0.299999999999999988898 .
-	 */
-	char buf[64];
-	snprintf(buf, sizeof(buf), "%.16g", num);
+	char buf[32], *p, digits[20];
+	int len, K, exp10;
 	
-	if (number_is_valid(buf))
-		sb_puts(out, buf);
-	else
+	if (!isfinite(num)) {
 		sb_puts(out, "null");
+		return;
+	}
+	
+	p = buf;
+	if (signbit(num)) {
+		*p++ = '-';
+		num = -num;
+	}
+	
+	/* Integers below 10^16 print as they are */
+	if (num < 1e16 && num == (double)(uint64_t) num) {
+		char *end = buf + sizeof(buf), *s = write_u64(end, (uint64_t) num);
+		
+		if (p > buf)
+			*--s = '-';
+		sb_put(out, s, end - s);
+		return;
+	}
+	
+	len = grisu2(num, digits, &K);
+	while (len > 1 && digits[len - 1] == '0') {
+		len--;
+		K++;
+	}
+	exp10 = len + K - 1;	/* num = d.ddd * 10^exp10 */
+	
+	if (exp10 < -4 || exp10 >= 16) {
+		*p++ = digits[0];
+		if (len > 1) {
+			*p++ = '.';
+			memcpy(p, digits + 1, len - 1);
+			p += len - 1;
+		}
+		*p++ = 'e';
+		*p++ = exp10 < 0 ? '-' : '+';
+		if (exp10 < 0)
+			exp10 = -exp10;
+		if (exp10 < 10)
+			*p++ = '0';
+		p += snprintf(p, 4, "%d", exp10);
+	} else if (exp10 < 0) {
+		*p++ = '0';
+		*p++ = '.';
+		memset(p, '0', -exp10 - 1);
+		p += -exp10 - 1;
+		memcpy(p, digits, len);
+		p += len;
+	} else if (K >= 0) {
+		memcpy(p, digits, len);
+		memset(p + len, '0', K);
+		p += len + K;
+	} else {
+		memcpy(p, digits, exp10 + 1);
+		p += exp10 + 1;
+		*p++ = '.';
+		memcpy(p, digits + exp10 + 1, len - exp10 - 1);
+		p += len - exp10 - 1;
+	}
+	
+	sb_put(out, buf, p - buf);
 }
 
 static bool tag_is_valid(unsigned int tag)
@@ -1345,11 +4250,6 @@ static bool tag_is_valid(unsigned int tag)
 	return (/* tag >= JSON_NULL && */ tag <= JSON_OBJECT);
 }
 
-static bool number_is_valid(const char *num)
-{
-	return (parse_number(&num, NULL) && *num == '\0');
-}
-
 static bool expect_literal(const char **sp, const char *str)
 {
 	const char *s = *sp;
@@ -1429,10 +4329,25 @@ bool json_check(const JsonNode *node, char errmsg[256])
 		if (node->bool_ != false && node->bool_ != true)
 			problem("bool_ is neither false (%d) nor true (%d)", (int)false, (int)true);
 	} else if (node->tag == JSON_STRING) {
-		if (node->string_ == NULL)
-			problem("string_ is NULL");
-		if (!utf8_validate(node->string_))
-			problem("string_ contains invalid UTF-8");
+		if (node->lazy) {
+			if (node->lazy_.read == NULL)
+				problem("lazy_.read is NULL");
+		} else {
+			if (node->string_ == NULL)
+				problem("string_ is NULL");
+			if (!utf8_validate(node->string_))
+				problem("string_ contains invalid UTF-8");
+		}
+	} else if (node->on_tape) {
+		if (node->tape_.tape == NULL)
+			problem("tape_.tape is NULL");
+		if (json_tape_tag(node->tape_.tape, node->tape_.index) != node->tag)
+			problem("tape_.index does not match tag");
+	} else if (node->raw) {
+		if (node->raw_.text == NULL)
+			problem("raw_.text is NULL");
+		if (node->raw_.text[0] != (node->tag == JSON_OBJECT ? '{' : '['))
+			problem("raw_.text does not match tag");
 	} else if (node->tag == JSON_ARRAY || node->tag == JSON_OBJECT) {
 		JsonNode *head = node->children.head;
 		JsonNode *tail = node->children.tail;
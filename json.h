@@ -26,6 +26,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
 
 typedef enum {
 	JSON_NULL,
@@ -37,6 +38,17 @@ typedef enum {
 } JsonTag;
 
 typedef struct JsonNode JsonNode;
+typedef struct JsonTape JsonTape;
+typedef struct JsonArena JsonArena;
+
+/*
+ * Supplies the contents of a lazy string (see json_mkstring_lazy) while it
+ * is being written: store up to `size' bytes in `buf' and return how many,
+ * 0 at the end (the next call starts over), or -1 on error, which makes
+ * json_stringify return NULL and json_write return false.  The bytes are
+ * written as they are, so they must be valid UTF-8 that needs no escaping.
+ */
+typedef long (*JsonReader)(void *ctx, char *buf, size_t size);
 
 struct JsonNode
 {
@@ -47,7 +59,26 @@ struct JsonNode
 	/* only if parent is an object (NULL otherwise) */
 	char *key; /* Must be valid UTF-8. */
 	
+	/* the JsonArena node, key and string_ live in (never free()d one by
+	   one), or NULL */
+	JsonArena *arena;
+	
 	JsonTag tag;
+	
+	/* string_ or number_text_ belongs to someone else and outlives the node
+	   (json_mkstring_ref, json_tape_node) */
+	unsigned int borrowed : 1;
+	/* JSON_STRING whose contents come from lazy_ on output */
+	unsigned int lazy : 1;
+	/* key and string_ were checked to be valid UTF-8 when they were stored */
+	unsigned int validated : 1;
+	/* JSON_ARRAY or JSON_OBJECT still held as its text in raw_ */
+	unsigned int raw : 1;
+	/* JSON_ARRAY or JSON_OBJECT whose children are still on tape_ */
+	unsigned int on_tape : 1;
+	/* key is shared, from the table of interned keys */
+	unsigned int key_interned : 1;
+	
 	union {
 		/* JSON_BOOL */
 		bool bool_;
@@ -55,26 +86,74 @@ struct JsonNode
 		/* JSON_STRING */
 		char *string_; /* Must be valid UTF-8. */
 		
+		/* JSON_STRING made by json_mkstring_lazy */
+		struct {
+			JsonReader read;
+			void *ctx;
+		} lazy_;
+		
 		/* JSON_NUMBER */
-		double number_;
+		struct {
+			/* Not set if number_text_ is; use json_number() */
+			double number_;
+			/* The number as written (valid JSON), or NULL */
+			char *number_text_;
+		};
 		
 		/* JSON_ARRAY */
 		/* JSON_OBJECT */
 		struct {
 			JsonNode *head, *tail;
+			/* member lookup table, built once an object grows large */
+			struct JsonIndex *index;
 		} children;
+		
+		/* JSON_ARRAY or JSON_OBJECT made by json_decode_raw, until its
+		   children are needed (borrowed applies to text) */
+		struct {
+			char *text;
+			size_t len;
+		} raw_;
+		
+		/* JSON_ARRAY or JSON_OBJECT made by json_tape_node, until its
+		   children are needed */
+		struct {
+			const JsonTape *tape;
+			size_t index;
+		} tape_;
 	};
 };
 
 /*** Encoding, decoding, and validation ***/
 
 JsonNode   *json_decode         (const char *json);
+JsonNode   *json_decode_raw     (const char *json);
+JsonNode   *json_decode_raw_ref (const char *json);
+JsonNode   *json_decode_raw_checked(const char *json);
 char       *json_encode         (const JsonNode *node);
 char       *json_encode_string  (const char *str);
 char       *json_stringify      (const JsonNode *node, const char *space);
+bool        json_write          (FILE *fp, const JsonNode *node, const char *space);
 void        json_delete         (JsonNode *node);
 
 bool        json_validate       (const char *json);
+bool        json_validate_number(const char *num);
+
+/*
+ * json_validate may run in several threads at once, so that documents can
+ * be checked in parallel and then decoded, one thread at a time, with
+ * json_decode_raw_checked (which does not check them again).  Nothing
+ * else here may be called from more than one thread.
+ */
+
+/*
+ * Documents may nest objects and arrays this deeply, by default; anything
+ * deeper fails to decode or validate.  json_set_max_depth changes the
+ * limit for everything decoded after it, and 0 lifts it.
+ */
+#define JSON_MAX_DEPTH 10000
+
+void        json_set_max_depth  (size_t depth);
 
 /*** Lookup and traversal ***/
 
@@ -93,7 +172,11 @@ JsonNode   *json_first_child    (const JsonNode *node);
 JsonNode *json_mknull(void);
 JsonNode *json_mkbool(bool b);
 JsonNode *json_mkstring(const char *s);
+JsonNode *json_mkstring_ref(const char *s);
+JsonNode *json_mkstring_lazy(JsonReader read, void *ctx);
 JsonNode *json_mknumber(double n);
+JsonNode *json_mknumber_text(const char *num);
+double    json_number(const JsonNode *node);
 JsonNode *json_mkarray(void);
 JsonNode *json_mkobject(void);
 
@@ -105,6 +188,68 @@ void json_dedup_members(bool b);
 
 void json_remove_from_parent(JsonNode *node);
 
+/*
+ * Apply @patch to @target as a JSON merge patch (RFC 7396) and return the
+ * result.  Both are used up: the result is made of their nodes, moved
+ * rather than copied, and whatever is left over is deleted.  @target may
+ * be NULL.
+ */
+JsonNode *json_merge_patch(JsonNode *target, JsonNode *patch);
+
+/*** Tapes ***/
+
+/*
+ * A tape is a decoded document laid out flat: one entry per scalar and
+ * two per object or array (where it opens and where it closes), in
+ * document order, with the contents of every key, string and number
+ * in a single buffer.  Values are addressed by their index on the tape;
+ * the document's top-level value is at JSON_TAPE_ROOT, and 0 means none.
+ */
+#define JSON_TAPE_ROOT 1
+
+JsonTape   *json_tape_decode    (const char *json);
+JsonTape   *json_tape_from_node (const JsonNode *node);
+void        json_tape_free      (JsonTape *tape);
+
+JsonTag     json_tape_tag       (const JsonTape *tape, size_t i);
+size_t      json_tape_first     (const JsonTape *tape, size_t i);
+size_t      json_tape_next      (const JsonTape *tape, size_t i);
+const char *json_tape_key       (const JsonTape *tape, size_t i);
+const char *json_tape_text      (const JsonTape *tape, size_t i, size_t *len);
+bool        json_tape_bool      (const JsonTape *tape, size_t i);
+
+#define json_tape_foreach(i, tape, object_or_array)        \
+	for ((i) = json_tape_first(tape, object_or_array);    \
+		 (i) != 0;                                        \
+		 (i) = json_tape_next(tape, i))
+
+/*
+ * Make a node for value @i.  The children of an object or array are made
+ * when they are first needed, and strings and numbers stay on the tape,
+ * which must outlive the nodes.
+ */
+JsonNode   *json_tape_node      (const JsonTape *tape, size_t i);
+char       *json_tape_stringify (const JsonTape *tape, size_t i, const char *space);
+bool        json_tape_write     (FILE *fp, const JsonTape *tape, size_t i, const char *space);
+
+/*** Memory management ***/
+
+/*
+ * An arena hands out node, key and string storage from large blocks.
+ * While an arena is in use (see json_arena_use), every node created is
+ * allocated from it; json_delete on such nodes only unlinks them, and
+ * the memory of a whole document is released at once by json_arena_reset
+ * or json_arena_free.  Keys and strings given to a node later, and the
+ * children of an object or array decoded later, come from the node's own
+ * arena, whichever is in use then.  Do not mix arena and heap nodes in one
+ * tree.
+ */
+
+JsonArena  *json_arena_new      (void);
+JsonArena  *json_arena_use      (JsonArena *arena);
+void        json_arena_reset    (JsonArena *arena);
+void        json_arena_free     (JsonArena *arena);
+
 /*** Debugging ***/
 
 /*
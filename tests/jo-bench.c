@@ -0,0 +1,410 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "json.h"
+#include "base64.h"
+
+/*
+ * Microbenchmarks for the hot paths of json.c, base64.c and jo.c, run by
+ * `meson test --benchmark'. jo.c is linked in with its main renamed to
+ * jo_main, for vnode.
+ *
+ * Every case is repeated until it has run for at least BENCH_MIN_NS, and
+ * the results are written on stdout as one JSON document:
+ *
+ *	{"benchmarks":[{"name":"json_decode/jo-large1.json","iterations":128,
+ *	  "ns_per_op":51234.5,"mb_per_s":556.3}, ...]}
+ *
+ * where an op is one call of what is measured (one document decoded, one
+ * string written, one member inserted, ...), and mb_per_s, given where a
+ * case works through input, counts its bytes. The JSON files named as
+ * arguments are decoded, validated and written besides the corpora made
+ * up here.
+ */
+
+#define BENCH_MIN_NS	(200 * 1000 * 1000)
+
+/* Strings, numbers and words per array; records per generated document */
+#define BENCH_ITEMS	1024
+
+JsonNode *vnode(char *str, int flags);
+
+typedef void (*BenchFn)(void *ctx);
+
+static JsonNode *results;
+static JsonArena *arena;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+/*
+ * Time `fn' on `ctx', which does `ops' ops through `bytes' bytes each
+ * call, and add the result to the document.
+ */
+
+static void bench(const char *name, BenchFn fn, void *ctx, size_t bytes, size_t ops)
+{
+	double start, elapsed;
+	size_t iterations = 1, i;
+	JsonNode *r;
+
+	fn(ctx);		/* warm up */
+	for (;;) {
+		start = now_ns();
+		for (i = 0; i < iterations; i++) {
+			fn(ctx);
+		}
+		if ((elapsed = now_ns() - start) >= BENCH_MIN_NS) {
+			break;
+		}
+		iterations *= (elapsed > BENCH_MIN_NS / 16) ? 2 : 16;
+	}
+
+	r = json_mkobject();
+	json_append_member(r, "name", json_mkstring(name));
+	json_append_member(r, "iterations", json_mknumber(iterations));
+	json_append_member(r, "ns_per_op", json_mknumber(elapsed / iterations / ops));
+	if (bytes > 0) {
+		json_append_member(r, "mb_per_s", json_mknumber(bytes * iterations / elapsed * 1e3));
+	}
+	json_append_element(results, r);
+	fprintf(stderr, "%-40s %12.1f ns/op\n", name, elapsed / iterations / ops);
+}
+
+/*
+ * Decoding, validating and writing whole documents
+ */
+
+typedef struct {
+	const char *text;
+	JsonNode *tree;
+	const char *space;
+} Doc;
+
+static void run_decode(void *ctx)
+{
+	Doc *doc = ctx;
+
+	json_arena_use(arena);
+	if (json_decode(doc->text) == NULL) {
+		fprintf(stderr, "jo-bench: cannot decode corpus\n");
+		exit(1);
+	}
+	json_arena_use(NULL);
+	json_arena_reset(arena);
+}
+
+static void run_validate(void *ctx)
+{
+	Doc *doc = ctx;
+
+	if (!json_validate(doc->text)) {
+		fprintf(stderr, "jo-bench: invalid corpus\n");
+		exit(1);
+	}
+}
+
+static void run_stringify(void *ctx)
+{
+	Doc *doc = ctx;
+
+	free(json_stringify(doc->tree, doc->space));
+}
+
+static void bench_document(const char *name, const char *text)
+{
+	Doc doc = { text, NULL, NULL };
+	char label[256];
+	size_t len = strlen(text);
+
+	if ((doc.tree = json_decode(text)) == NULL) {
+		fprintf(stderr, "jo-bench: cannot decode %s\n", name);
+		exit(1);
+	}
+	snprintf(label, sizeof(label), "json_decode/%s", name);
+	bench(label, run_decode, &doc, len, 1);
+	snprintf(label, sizeof(label), "json_validate/%s", name);
+	bench(label, run_validate, &doc, len, 1);
+	snprintf(label, sizeof(label), "json_stringify/%s/compact", name);
+	bench(label, run_stringify, &doc, len, 1);
+	doc.space = "   ";
+	snprintf(label, sizeof(label), "json_stringify/%s/pretty", name);
+	bench(label, run_stringify, &doc, len, 1);
+	json_delete(doc.tree);
+}
+
+static char *read_file(const char *filename)
+{
+	FILE *fp;
+	char *buf;
+	long len;
+
+	if ((fp = fopen(filename, "rb")) == NULL || fseek(fp, 0, SEEK_END) != 0 ||
+	    (len = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) != 0 ||
+	    (buf = malloc(len + 1)) == NULL || fread(buf, 1, len, fp) != (size_t)len) {
+		perror(filename);
+		exit(1);
+	}
+	buf[len] = 0;
+	fclose(fp);
+	return (buf);
+}
+
+/*
+ * An array of records like those jo makes, of every type, with keys that
+ * repeat.
+ */
+
+static char *make_records(void)
+{
+	JsonNode *array = json_mkarray(), *rec;
+	char text[64], *ret;
+	int i;
+
+	for (i = 0; i < BENCH_ITEMS * 8; i++) {
+		rec = json_mkobject();
+		json_append_member(rec, "id", json_mknumber(i));
+		snprintf(text, sizeof(text), "user%d@example.org", i * 7919 % 100003);
+		json_append_member(rec, "email", json_mkstring(text));
+		json_append_member(rec, "score", json_mknumber(i * 0.37 - 100));
+		json_append_member(rec, "active", json_mkbool(i % 3 == 0));
+		json_append_member(rec, "note", i % 5 ? json_mknull() : json_mkstring("line one\nline \"two\"\tend"));
+		json_append_member(rec, "tags", json_decode("[\"a\",\"bb\",\"ccc\"]"));
+		json_append_element(array, rec);
+	}
+	ret = json_stringify(array, NULL);
+	json_delete(array);
+	return (ret);
+}
+
+/*
+ * Writing strings and numbers: arrays of one kind, written compactly
+ */
+
+static void run_stringify_tree(void *ctx)
+{
+	free(json_stringify(ctx, NULL));
+}
+
+static void bench_strings(const char *name, const char *piece)
+{
+	JsonNode *array = json_mkarray();
+	char label[64], text[256];
+	size_t len = 0;
+	int i;
+
+	text[0] = 0;
+	while (strlen(text) + strlen(piece) < 100) {
+		strcat(text, piece);
+	}
+	for (i = 0; i < BENCH_ITEMS; i++) {
+		json_append_element(array, json_mkstring(text));
+		len += strlen(text);
+	}
+	snprintf(label, sizeof(label), "emit_string/%s", name);
+	bench(label, run_stringify_tree, array, len, BENCH_ITEMS);
+	json_delete(array);
+}
+
+static void bench_numbers(void)
+{
+	JsonNode *doubles = json_mkarray(), *texts = json_mkarray();
+	char text[32];
+	int i;
+
+	for (i = 0; i < BENCH_ITEMS; i++) {
+		json_append_element(doubles, json_mknumber((i % 2 ? i : -i) * 1234.5678 / 7));
+		snprintf(text, sizeof(text), "%d.%03de%d", i, i % 1000, i % 20);
+		json_append_element(texts, json_mknumber_text(text));
+	}
+	bench("emit_number/double", run_stringify_tree, doubles, 0, BENCH_ITEMS);
+	bench("emit_number/text", run_stringify_tree, texts, 0, BENCH_ITEMS);
+	json_delete(doubles);
+	json_delete(texts);
+}
+
+/*
+ * base64_encode
+ */
+
+typedef struct {
+	unsigned char *buf;
+	size_t len;
+} Blob;
+
+static void run_base64(void *ctx)
+{
+	Blob *blob = ctx;
+
+	free(base64_encode(blob->buf, blob->len));
+}
+
+static void bench_base64(size_t len)
+{
+	Blob blob;
+	char label[64];
+	size_t i;
+
+	if ((blob.buf = malloc(len)) == NULL) {
+		exit(1);
+	}
+	for (i = 0; i < len; i++) {
+		blob.buf[i] = (unsigned char)(i * 131 + (i >> 8));
+	}
+	blob.len = len;
+	snprintf(label, sizeof(label), "base64_encode/%zu", len);
+	bench(label, run_base64, &blob, len, 1);
+	free(blob.buf);
+}
+
+/*
+ * vnode: guessing the type of words as jo does, into an arena
+ */
+
+typedef struct {
+	char *words[BENCH_ITEMS];
+	size_t len;
+} Words;
+
+static void run_vnode(void *ctx)
+{
+	Words *w = ctx;
+	int i;
+
+	json_arena_use(arena);
+	for (i = 0; i < BENCH_ITEMS; i++) {
+		vnode(w->words[i], 0);
+	}
+	json_arena_use(NULL);
+	json_arena_reset(arena);
+}
+
+static void bench_vnode(const char *name, const char *word)
+{
+	Words w;
+	char label[64];
+	int i;
+
+	w.len = 0;
+	for (i = 0; i < BENCH_ITEMS; i++) {
+		if ((w.words[i] = strdup(word)) == NULL) {
+			exit(1);
+		}
+		w.len += strlen(word);
+	}
+	snprintf(label, sizeof(label), "vnode/%s", name);
+	bench(label, run_vnode, &w, w.len, BENCH_ITEMS);
+	for (i = 0; i < BENCH_ITEMS; i++) {
+		free(w.words[i]);
+	}
+}
+
+/*
+ * Inserting members with -D: `count' new keys and then each of them
+ * again, into an object in an arena
+ */
+
+typedef struct {
+	char **keys;
+	int count;
+} Members;
+
+static void run_dedup(void *ctx)
+{
+	Members *m = ctx;
+	JsonNode *object;
+	int i;
+
+	json_arena_use(arena);
+	object = json_mkobject();
+	for (i = 0; i < m->count * 2; i++) {
+		json_append_member(object, m->keys[i % m->count], json_mknumber(i));
+	}
+	json_arena_use(NULL);
+	json_arena_reset(arena);
+}
+
+static void bench_dedup(int count)
+{
+	Members m;
+	char label[64], key[32];
+	int i;
+
+	if ((m.keys = calloc(count, sizeof(char *))) == NULL) {
+		exit(1);
+	}
+	for (i = 0; i < count; i++) {
+		snprintf(key, sizeof(key), "member%d", i);
+		if ((m.keys[i] = strdup(key)) == NULL) {
+			exit(1);
+		}
+	}
+	m.count = count;
+	json_dedup_members(true);
+	snprintf(label, sizeof(label), "dedup_insert/%d", count);
+	bench(label, run_dedup, &m, 0, count * 2);
+	json_dedup_members(false);
+	for (i = 0; i < count; i++) {
+		free(m.keys[i]);
+	}
+	free(m.keys);
+}
+
+int main(int argc, char **argv)
+{
+	JsonNode *doc;
+	char *text;
+	const char *name;
+	int i;
+
+	results = json_mkarray();
+	arena = json_arena_new();
+
+	for (i = 1; i < argc; i++) {
+		text = read_file(argv[i]);
+		name = (name = strrchr(argv[i], '/')) ? name + 1 : argv[i];
+		bench_document(name, text);
+		free(text);
+	}
+	text = make_records();
+	bench_document("generated-records", text);
+	free(text);
+
+	bench_strings("ascii", "The quick brown fox jumps over the lazy dog. ");
+	bench_strings("escaped", "tab\there \"quoted\" back\\slash\n");
+	bench_strings("multibyte", "Grüße, 世界! Ελληνικά ");
+	bench_numbers();
+
+	bench_base64(48);
+	bench_base64(4096);
+	bench_base64(1024 * 1024);
+
+	bench_vnode("integer", "1457081292");
+	bench_vnode("float", "12.3456");
+	bench_vnode("bool", "true");
+	bench_vnode("string", "JP Mens");
+	bench_vnode("quoted", "\"0x10\"");
+	bench_vnode("json", "{\"x\":10,\"y\":[1,2,3]}");
+
+	bench_dedup(16);
+	bench_dedup(256);
+	bench_dedup(4096);
+	bench_dedup(65536);
+
+	doc = json_mkobject();
+	json_append_member(doc, "benchmarks", results);
+	if (!json_write(stdout, doc, NULL) || putchar('\n') == EOF || fflush(stdout) == EOF) {
+		perror("jo-bench");
+		return (1);
+	}
+	json_delete(doc);
+	json_arena_free(arena);
+	return (0);
+}
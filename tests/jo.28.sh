@@ -0,0 +1,15 @@
+# record-stream mode
+printf 'a=1\nb=2\n\nc=3\n\n\nd=4' | ${JO:-jo} -r
+
+# records separated by NUL bytes
+printf 'a=1\000b=x y\000\000c=3\n' | ${JO:-jo} -r
+
+# arrays and nesting are per record, -p is ignored
+printf '1\n2\n\n3\n' | ${JO:-jo} -r -a -p
+printf 'geo[lat]=1\ngeo[lon]=2\n\ngeo[lat]=3\n' | ${JO:-jo} -r
+
+# every record starts from the -f document
+tmpf=$$.json
+trap 'rm -f "$tmpf"' 0 1 2 15
+${JO:-jo} base=true > $tmpf
+printf 'a=1\n\nb=2\n' | ${JO:-jo} -r -f $tmpf
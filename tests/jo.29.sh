@@ -0,0 +1,26 @@
+# coprocess requests
+printf 'a=1\n-s\nb=2\n\n-n\nc=hello\nd[]=1\n\n\n' | ${JO:-jo} -c
+
+# a last request without its empty line is answered too
+printf 'x=1\ny=2' | ${JO:-jo} -c -a
+
+# -u: one reply per request on each connection; a request that fails ends
+# only its own connection
+sock=${TMPDIR:-/tmp}/jo.29.$$
+${JO:-jo} -u "$sock" 2>/dev/null &
+pid=$!
+trap 'kill $pid 2>/dev/null; rm -f "$sock"' 0 1 2 15
+n=0
+while [ ! -S "$sock" ] && [ $n -lt 10 ]; do
+	sleep 1
+	n=$(expr $n + 1)
+done
+perl -MIO::Socket::UNIX -e '
+	$path = shift;
+	for (@ARGV) {
+		s/\\n/\n/g;
+		$s = IO::Socket::UNIX->new(Peer => $path) or die "$path: $!\n";
+		print $s $_;
+		shutdown($s, 1);
+		print while <$s>;
+	}' "$sock" 'a=1\n\nb=2\n\n' 'a[]=1\na[b]=2\n\nc=3\n\n' 'd=4\n\n'
@@ -0,0 +1,7 @@
+# words on stdin may end in CRLF or NUL
+printf 'a=1\r\nb=x y\r\nc=\r\n' | ${JO:-jo}
+printf 'a=1\000b=2\000c=3' | ${JO:-jo}
+
+# a long word and a last line without newline
+awk 'BEGIN { s = "v="; for (i = 0; i < 20000; i++) s = s "abcdefgh"; print s }' | ${JO:-jo} | wc -c | tr -d ' '
+printf '1\n2\n3' | ${JO:-jo} -a
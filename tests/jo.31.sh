@@ -0,0 +1,13 @@
+# base64 of every length up to a few vector blocks
+tmpd=${TMPDIR:-/tmp}/jo.31.$$
+trap 'rm -rf "$tmpd"' 0 1 2 15
+mkdir -p $tmpd
+n=0
+while [ $n -le 100 ]; do
+	dd if=${srcdir:=.}/tests/jo-logo.png of=$tmpd/$n bs=1 count=$n 2>/dev/null
+	${JO:-jo} -a $n %$tmpd/$n
+	n=$(expr $n + 1)
+done
+
+# the same from a pipe
+dd if=${srcdir:=.}/tests/jo-logo.png bs=1 count=100 2>/dev/null | ${JO:-jo} -a 100 %-
@@ -0,0 +1,6 @@
+# invalid UTF-8 is replaced by U+FFFD
+tmpf=${TMPDIR:-/tmp}/jo.32.$$
+trap 'rm -f "$tmpf"' 0 1 2 15
+printf 'ab\377c\303\251\342\202' > $tmpf
+${JO:-jo} a=@$tmpf "$(printf 'k\376')"=x
+printf 'w=\300\257\n' | ${JO:-jo}
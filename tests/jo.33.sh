@@ -0,0 +1,3 @@
+# numbers: JSON numbers as written, others with digits that read back as the same double, usually the fewest
+${JO:-jo} -a -- 0 -0 1.0 1e15 1E+16 123456789012345678901234567890 2.50 0.1 -0.0e0 1e400
+${JO:-jo} -a -- +0 -.0 +42 .1 +1e16 +123456789012345678 +.30000000000000004 0x1p-1074 +1.7976931348623157e308 0x10
@@ -0,0 +1,7 @@
+# embedded JSON is written out compact, whether or not it is changed later
+tmpf=${TMPDIR:-/tmp}/jo.34.$$
+trap 'rm -f "$tmpf"' 0 1 2 15
+printf ' { "a" : [1, 2.50, "x\\/y\\u0041"] ,\n "b\\"c": "\303\251" }\n' > $tmpf
+${JO:-jo} x=:$tmpf y:=$tmpf z='[ 1 , { "q" : true } ]'
+${JO:-jo} x=:$tmpf x[d]=4 y:=$tmpf y[a][]=3
+${JO:-jo} -p -a :$tmpf
@@ -0,0 +1,8 @@
+# documents loaded with -f, as they are and after changes
+tmpf=${TMPDIR:-/tmp}/jo.35.$$
+trap 'rm -f "$tmpf"' 0 1 2 15
+printf '{ "a" : [1, 2.50, {}, [ ]], "b\\"c": "\\u00e9\\ud83d\\ude00\\n",\n "a": {"d": null} }\n' > $tmpf
+${JO:-jo} -f $tmpf x=1
+${JO:-jo} -D -f $tmpf a[e]=true
+${JO:-jo} -p -f $tmpf z=2
+printf 'x=1\n\ny=2\n' | ${JO:-jo} -r -f $tmpf
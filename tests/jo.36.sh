@@ -0,0 +1,4 @@
+# words that look like JSON are embedded only if they are valid
+${JO:-jo} -a '{"a":"\"}"}' '{"a":"\\"}"}' '["😀"]' '["\udc00"]' '[1,]' '[01]' '{"a" 1}' '[1 2]'
+${JO:-jo} -a "$(printf '["a\tb"]')" "$(printf '[\n"a",\t"b"\r\n]')" "$(printf '["\303\251"]')" "$(printf '["\303"]')" '["a' '[[[[[]]]]]' '[[[[[]]]]'
+awk 'BEGIN { s = "["; for (i = 0; i < 100; i++) s = s "\"" i "\\\\\\\"abcdefgh\","; print s "1]" }' | ${JO:-jo} -a | wc -c | tr -d ' '
@@ -0,0 +1,3 @@
+# strings decoded in runs between escapes
+${JO:-jo} -D -a '{"a":"a long run of plain text, long enough for the vector scanners","a":"\t\"é\\/é😀end"}' '["\\"]' '["é\"'
+${JO:-jo} -D -a "$(printf '["ok\\n\tno"]')" "$(printf '["\\n\303"]')" "$(printf '["\303\\n"]')" '["\x"]' '["\u12"]'
@@ -0,0 +1,8 @@
+# keys shared between members are written the same as any other
+tmpf=${TMPDIR:-/tmp}/jo.38.$$
+trap 'rm -f "$tmpf"' 0 1 2 15
+long=kkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkkk
+printf '[{"a\\u00e9\\"":1,"%s":2},{"a\\u00e9\\"":3,"%s":4}]\n' $long $long > $tmpf
+${JO:-jo} -f $tmpf '{"a\"":{"a\"":[]}}'
+${JO:-jo} -p -D -f $tmpf true
+printf 'a\\b=1\n%s=2\n\na\\b=3\n' $long | ${JO:-jo} -r
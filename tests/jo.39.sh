@@ -0,0 +1,12 @@
+# documents merged with -m, as JSON merge patches
+tmpf=${TMPDIR:-/tmp}/jo.39.$$
+trap 'rm -f "$tmpf".*' 0 1 2 15
+printf '{"title":"Goodbye!","author":{"givenName":"John","familyName":"Doe"},"tags":["example","sample"],"content":"This will be unchanged"}' > $tmpf.f
+printf '{"title":"Hello!","phoneNumber":"+01-123-456-7890","author":{"familyName":null},"tags":["example"]}' > $tmpf.1
+printf '{"a":{"b":null,"c":{"d":null,"e":[null]}},"content":null}' > $tmpf.2
+printf '[1,{"x":null}]' > $tmpf.3
+${JO:-jo} -f $tmpf.f -m $tmpf.1 < /dev/null
+${JO:-jo} -f $tmpf.f -m $tmpf.1 -m $tmpf.2 -p n=1
+${JO:-jo} -m $tmpf.2 -m $tmpf.1 < /dev/null
+${JO:-jo} -m $tmpf.1 -m $tmpf.3 -a 2 3
+cat $tmpf.1 | ${JO:-jo} -D -m - -m $tmpf.2 title=Merged
@@ -0,0 +1,14 @@
+# deeply nested documents, up to the nesting limit
+tmpf=${TMPDIR:-/tmp}/jo.40.$$
+trap 'rm -f "$tmpf".*' 0 1 2 15
+nest () { awk -v n=$1 -v tail="$2" 'BEGIN { for (i = 0; i < n; i++) printf "["; if (tail != "") for (i = 0; i < n; i++) printf "]"; print "" }'; }
+nest 10000 close > $tmpf.1
+nest 10001 close > $tmpf.2
+nest 1000000 > $tmpf.3
+nest 100 close > $tmpf.4
+${JO:-jo} -a :$tmpf.1 | awk '{ print length }'
+${JO:-jo} -f $tmpf.1 -D 1 | awk '{ print length }'
+${JO:-jo} -m $tmpf.1 < /dev/null | awk '{ print length }'
+${JO:-jo} x=:$tmpf.2 2>/dev/null || echo "Test 4 should fail"
+${JO:-jo} x=:$tmpf.3 2>/dev/null || echo "Test 5 should fail"
+${JO:-jo} -p x=:$tmpf.4 | awk 'NR == 101 || NR == 102 { match($0, /^ */); print RLENGTH, substr($0, RLENGTH + 1) }'
@@ -0,0 +1,9 @@
+# pretty output indented with -i
+tmpf=${TMPDIR:-/tmp}/jo.41.$$
+trap 'rm -f "$tmpf"' 0 1 2 15
+printf '{"a":[1,{"b":[[],{}]}],"c":{"d":{"e":"f"}}}' > $tmpf
+${JO:-jo} -i 2 -f $tmpf g=1
+${JO:-jo} -i t x=:$tmpf | od -An -c | tr -s ' ' | head -4
+${JO:-jo} -i 0 -a :$tmpf
+${JO:-jo} -i 25 -D -f $tmpf c[h]=g | awk '{ match($0, /^ */); print RLENGTH, substr($0, RLENGTH + 1) }'
+${JO:-jo} -i 65 a=1 2>&1 || echo "Test 5 should fail"
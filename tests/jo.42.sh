@@ -0,0 +1,15 @@
+# files read by a pool of threads with -j
+tmpf=${TMPDIR:-/tmp}/jo.42.$$
+trap 'rm -f "$tmpf".*' 0 1 2 15
+printf '{"a":[1,2]}\n' > $tmpf.1
+printf '[true,null]' > $tmpf.2
+printf 'some text\r\n' > $tmpf.3
+printf '\001\002\003\377' > $tmpf.4
+printf '{"a":' > $tmpf.5
+set -- -- a=:$tmpf.1 b=@$tmpf.3 c=%$tmpf.4 d:=$tmpf.2 e=:$tmpf.2 f=:$tmpf.1 g=@$tmpf.1 -s h=@$tmpf.3
+${JO:-jo} -j 3 "$@"
+test "$(${JO:-jo} -j 4 -p "$@")" = "$(${JO:-jo} -p "$@")" || echo "Test 2 should match"
+${JO:-jo} -j 2 -a -- :$tmpf.2 %$tmpf.4 -n @$tmpf.3 :$tmpf.2
+${JO:-jo} -j 2 -a @$tmpf.1 @$tmpf.none 2>/dev/null || echo "Test 4 should fail"
+${JO:-jo} -j 2 a=:$tmpf.1 b=:$tmpf.5 2>/dev/null || echo "Test 5 should fail"
+${JO:-jo} -j 0 a=1 2>&1 || echo "Test 6 should fail"
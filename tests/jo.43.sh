@@ -0,0 +1,11 @@
+# records turned into documents by worker processes with -r -j
+tmpf=${TMPDIR:-/tmp}/jo.43.$$
+trap 'rm -f "$tmpf".*' 0 1 2 15
+awk 'BEGIN { for (i = 0; i < 30000; i++) printf "n=%d\r\ns=x%d\nv=[%d]\n%s", i, i, i, (i % 3) ? "\n" : "\0" }' > $tmpf.in
+${JO:-jo} -r < $tmpf.in > $tmpf.1
+${JO:-jo} -r -j 3 < $tmpf.in > $tmpf.3
+cmp -s $tmpf.1 $tmpf.3 || echo "Test 1 should match"
+wc -l < $tmpf.3 | tr -d ' '
+tail -1 $tmpf.3
+printf 'a=1\n\nb=:%s.none\n\nc=3\n' $tmpf | ${JO:-jo} -r -j 2 2>/dev/null || echo "Test 2 should fail"
+printf 'a=1\n\nb=2' | ${JO:-jo} -r -j 4
@@ -0,0 +1,14 @@
+# NUL-terminated words read with -A and -0
+tmpf=${TMPDIR:-/tmp}/jo.44.$$
+trap 'rm -f "$tmpf".*' 0 1 2 15
+printf 'a=1\0-s\0b=2\0text=one\ntwo\0-n\0c=abc\0' > $tmpf.w
+printf '[1,2]' > $tmpf.j
+${JO:-jo} -A $tmpf.w d=4
+${JO:-jo} -0 -p < $tmpf.w
+printf '1\0-b\0\0:%s.j\0last' $tmpf | ${JO:-jo} -0 -a -j 2 -- -s 3
+: > $tmpf.e
+${JO:-jo} -A $tmpf.e < /dev/null
+awk 'BEGIN { for (i = 0; i < 50000; i++) printf "k%d=%d%c", i, i, 0 }' > $tmpf.m
+${JO:-jo} -D -A $tmpf.m k7=seven | cut -c1-62
+${JO:-jo} -f - -A - < $tmpf.w 2>&1 || echo "Test 6 should fail"
+${JO:-jo} -r -0 < $tmpf.w 2>&1 || echo "Test 7 should fail"
@@ -0,0 +1,12 @@
+# files that say they are empty but are not, such as FIFOs and those in /proc
+tmpf=${TMPDIR:-/tmp}/jo.45.$$
+mkfifo "$tmpf.fifo" || exit 1
+printf xyz > "$tmpf.fifo" &
+pid=$!
+trap 'kill $pid 2>/dev/null; rm -f "$tmpf".*' 0 1 2 15
+test "$(${JO:-jo} a=%$tmpf.fifo)" = '{"a":"eHl6"}' || exit 1
+
+f=/proc/sys/kernel/pid_max
+test -r "$f" || exit 0
+v=$(cat $f)
+test "$(${JO:-jo} a=@$f b:=$f c=%$f)" = "$(cat $f | ${JO:-jo} -- -s a="$v" -n b="$v" c=%-)"